@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+# Converts gameconfig/game_*.xml into gamedesc.inc, the game descriptions
+# compiled into libmpromtool. Run again after editing any of the XML files.
+import glob
+import os
+import sys
+import xml.etree.ElementTree as ET
+
+
+def c_string(value):
+    return '"' + value.replace('\\', '\\\\').replace('"', '\\"') + '"'
+
+
+def parse_uint(value):
+    return int(value, 16) if value.lower().startswith('0x') else int(value)
+
+
+def parse_bool(value):
+    if value is None:
+        return False
+    if value in ('true', 'false'):
+        return value == 'true'
+    return int(value) != 0
+
+
+def array_ref(name, count):
+    if count == 0:
+        return 'nullptr, 0'
+    return 'BUILTIN_ARRAY(%s)' % name
+
+
+def emit_names(out, name, parent, tag):
+    names = []
+    if parent is not None:
+        names = [(parse_uint(elem.get('id')), elem.get('name')) for elem in parent.findall(tag)]
+    if names:
+        out.append('static constexpr BuiltinName %s[] = {' % name)
+        for id, value in names:
+            out.append('    { %d, %s },' % (id, c_string(value)))
+        out.append('};')
+    return array_ref(name, len(names))
+
+
+def emit_strings(out, name, values):
+    if values:
+        out.append('static constexpr const char* %s[] = {' % name)
+        for value in values:
+            out.append('    %s,' % c_string(value))
+        out.append('};')
+    return array_ref(name, len(values))
+
+
+def emit_game(out, gameid, root):
+    fields = [c_string(gameid), c_string(root.get('game'))]
+
+    segrefs = root.find('segrefs')
+    refs = segrefs.findall('segref') if segrefs is not None else []
+    if refs:
+        out.append('static constexpr BuiltinSegRef segrefs_%s[] = {' % gameid)
+        for ref in refs:
+            out.append('    { %s, 0x%X, 0x%X, %s },' % (c_string(ref.get('segname')), parse_uint(ref.get('hi')),
+                parse_uint(ref.get('lo')), 'true' if parse_bool(ref.get('end')) else 'false'))
+        out.append('};')
+    fields.append(array_ref('segrefs_' + gameid, len(refs)))
+
+    filedata = root.find('filedata')
+    fields.append(c_string(filedata.get('segname')))
+    fields.append(emit_names(out, 'datadirs_' + gameid, filedata, 'datadir'))
+
+    messdata = root.findall('messdata')
+    out.append('static constexpr BuiltinMessData messdata_%s[] = {' % gameid)
+    for elem in messdata:
+        out.append('    { %s, %s },' % (c_string(elem.get('segname')), 'true' if parse_bool(elem.get('use_dirmap')) else 'false'))
+    out.append('};')
+    fields.append(array_ref('messdata_' + gameid, len(messdata)))
+    fields.append(emit_names(out, 'messdirs_' + gameid, root.find('messdir_map'), 'messdir'))
+
+    hvqdata = root.find('hvqdata')
+    fields.append(c_string(hvqdata.get('segname')))
+    fields.append(emit_names(out, 'hvqbgs_' + gameid, hvqdata, 'hvqbg'))
+
+    bganimdata = root.find('bganimdata')
+    fields.append(c_string(bganimdata.get('segname') if bganimdata is not None else ''))
+    fields.append(emit_names(out, 'bganims_' + gameid, bganimdata, 'bganim'))
+
+    fields.append(emit_strings(out, 'musbanks_' + gameid, [elem.get('segname') for elem in root.findall('musbank')]))
+    fields.append(emit_strings(out, 'sfxbanks_' + gameid, [elem.get('segname') for elem in root.findall('sfxbank')]))
+    fields.append(c_string(root.find('fxdata').get('segname')))
+    out.append('')
+    return '    { ' + ', '.join(fields) + ' },'
+
+
+def main():
+    base_dir = os.path.dirname(os.path.abspath(__file__))
+    out_path = sys.argv[1] if len(sys.argv) > 1 else os.path.join(base_dir, 'gamedesc.inc')
+    out = ['// Generated by gen_gamedesc.py from gameconfig/game_*.xml. Do not edit.', '']
+    games = []
+    for path in sorted(glob.glob(os.path.join(base_dir, 'gameconfig', 'game_*.xml'))):
+        gameid = os.path.basename(path)[len('game_'):-len('.xml')]
+        games.append(emit_game(out, gameid, ET.parse(path).getroot()))
+    out.append('static constexpr BuiltinGameDesc builtin_gamedescs[] = {')
+    out.extend(games)
+    out.append('};')
+    with open(out_path, 'w', newline='\n') as file:
+        file.write('\n'.join(out) + '\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,4975 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(_WIN32)
+#include <direct.h>
+#include <intrin.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#endif
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CPU_X86
+#include <immintrin.h>
+#if !defined(_WIN32)
+#include <cpuid.h>
+#endif
+#endif
+#include "tinyxml2.h"
+#include "libmpromtool.h"
+
+#define BIT_ALIGN(V, N) (V + ((N - (V % N)) % N))
+#define DATA_MAGIC_PREFIX_SIZE 16
+#define FXDATA_HEADER_SIZE 16
+#define FXDATA_RECORD_SIZE 0x208
+#define SLIDE_CHUNK_SIZE 0x8000
+#define SLIDE_WINDOW_SIZE 0x1000
+#define SLIDE_MAX_MATCH (0xff + 0x12)
+#define LZ_WINDOW_SIZE 1024
+#define LZ_WINDOW_OFS 958
+#define LZ_MAX_MATCH 66
+#define MATCH_CHUNK_SIZE 0x8000
+#define MATCH_HASH_BITS 15
+#define MATCH_FAST_CHAIN 8
+#define URING_BATCH_FILES 64
+#define REBUILD_CACHE_MAGIC 0x4D504343 // MPCC
+#define REBUILD_CACHE_VERSION 1
+#define ARENA_SLAB_SIZE 0x100000
+#define FILEDATA_DUMP_WINDOW 256
+
+ThreadPool::ThreadPool(unsigned int num_threads)
+{
+    if (num_threads == 0) {
+        num_threads = 1;
+    }
+    for (unsigned int i = 0; i < num_threads; i++) {
+        workers.emplace_back(&ThreadPool::WorkerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cond.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::Submit(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+    cond.notify_one();
+}
+
+bool ThreadPool::RunPendingTask()
+{
+    std::function<void()> task;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (tasks.empty()) {
+            return false;
+        }
+        task = std::move(tasks.front());
+        tasks.pop_front();
+    }
+    task();
+    return true;
+}
+
+void ThreadPool::WorkerLoop()
+{
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this]() { return stop || !tasks.empty(); });
+            if (tasks.empty()) {
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void TaskGroup::Run(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending++;
+    }
+    pool.Submit([this, task]() {
+        std::exception_ptr task_error;
+        try {
+            task();
+        }
+        catch (...) {
+            task_error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (task_error && !error) {
+            error = task_error;
+        }
+        if (--pending == 0) {
+            cond.notify_all();
+        }
+        });
+}
+
+void TaskGroup::Wait()
+{
+    WaitPending();
+    if (error) {
+        std::exception_ptr task_error = error;
+        error = nullptr;
+        std::rethrow_exception(task_error);
+    }
+}
+
+void TaskGroup::WaitPending()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (pending != 0) {
+        lock.unlock();
+        bool ran_task = pool.RunPendingTask();
+        lock.lock();
+        if (!ran_task && pending != 0) {
+            cond.wait_for(lock, std::chrono::milliseconds(1));
+        }
+    }
+}
+
+uint8_t* ByteArena::Allocate(size_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (size > ARENA_SLAB_SIZE / 4) {
+        // Large blocks get a slab of their own so the current one is not wasted
+        slabs.emplace_back(new uint8_t[size]);
+        return slabs.back().get();
+    }
+    if (size > remaining) {
+        slabs.emplace_back(new uint8_t[ARENA_SLAB_SIZE]);
+        next = slabs.back().get();
+        remaining = ARENA_SLAB_SIZE;
+    }
+    uint8_t* block = next;
+    next += size;
+    remaining -= size;
+    return block;
+}
+
+void ByteArena::Clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    slabs.clear();
+    next = nullptr;
+    remaining = 0;
+}
+
+bool DecodeCache::Find(uint32_t key, DecodedData& data)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = by_key.find(key);
+    if (it == by_key.end()) {
+        return false;
+    }
+    entries.splice(entries.begin(), entries, it->second);
+    data = it->second->data;
+    return true;
+}
+
+void DecodeCache::Insert(uint32_t key, const DecodedData& data, size_t limit)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (by_key.count(key) != 0) {
+        // Decoded by two threads at once; the first copy is kept
+        return;
+    }
+    entries.push_front({ key, data });
+    by_key[key] = entries.begin();
+    size += data.data.size();
+    while (size > limit) {
+        const Entry& oldest = entries.back();
+        size -= oldest.data.data.size();
+        by_key.erase(oldest.key);
+        entries.pop_back();
+    }
+}
+
+void DecodeCache::Clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    by_key.clear();
+    size = 0;
+}
+
+bool MakeDirectory(std::string dir)
+{
+    int ret;
+#if defined(_WIN32)
+    ret = _mkdir(dir.c_str());
+#else 
+    ret = mkdir(dir.c_str(), 0777); // notice that 777 is different than 0777
+#endif
+    return ret != -1 || errno == EEXIST;
+}
+
+
+void XMLCheck(tinyxml2::XMLError error)
+{
+    if (error != tinyxml2::XML_SUCCESS) {
+        throw RomError(std::string("tinyxml2 error ") + tinyxml2::XMLDocument::ErrorIDToName(error));
+    }
+}
+
+uint8_t RomContext::ReadRom8(uint32_t offset)
+{
+    if (offset < rom_data.size()) {
+        return rom_data[offset];
+    }
+    else {
+        return 0;
+    }
+
+}
+
+uint16_t RomContext::ReadRom16(uint32_t offset)
+{
+    return (ReadRom8(offset) << 8) | ReadRom8(offset + 1);
+}
+
+uint32_t RomContext::ReadRom32(uint32_t offset)
+{
+    return (ReadRom16(offset) << 16) | ReadRom16(offset + 2);
+}
+
+std::string RomContext::ReadRomGameID()
+{
+    std::string string;
+    string.push_back(ReadRom8(59));
+    string.push_back(ReadRom8(60));
+    string.push_back(ReadRom8(61));
+    string.push_back(ReadRom8(62));
+    return string;
+}
+
+void ReadWholeFile(std::string path, std::vector<uint8_t>& data)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        throw RomError("Failed to open " + path + " for reading.");
+    }
+    fseek(file, 0, SEEK_END);
+    size_t size = ftell(file);
+    if (size == 0) {
+        fclose(file);
+        data.clear();
+        return;
+    }
+    data.resize(size);
+    fseek(file, 0, SEEK_SET);
+    fread(&data[0], 1, size, file);
+    fclose(file);
+}
+
+// Size and modification time of a file, false if it cannot be found
+static bool StatFile(const std::string& path, uint64_t& size, int64_t& mtime)
+{
+#if defined(_WIN32)
+    struct _stat64 info;
+    if (_stat64(path.c_str(), &info) != 0) {
+        return false;
+    }
+    mtime = (int64_t)info.st_mtime * 1000000000;
+#else
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        return false;
+    }
+#if defined(__APPLE__)
+    mtime = (int64_t)info.st_mtimespec.tv_sec * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+    mtime = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+#endif
+    size = info.st_size;
+    return true;
+}
+
+static inline uint64_t RotateLeft64(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// 64-bit content hash for change detection and for finding duplicate data,
+// eight bytes per step in the style of xxHash64. Words are read little-endian
+// so every host agrees.
+static uint64_t HashBytes(ByteView bytes)
+{
+    const uint8_t* data = bytes.data();
+    size_t size = bytes.size();
+    const uint64_t prime1 = 0x9E3779B185EBCA87;
+    const uint64_t prime2 = 0xC2B2AE3D27D4EB4F;
+    uint64_t hash = (uint64_t)size * prime1;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word = 0;
+        for (int j = 7; j >= 0; j--) {
+            word = (word << 8) | data[i + j];
+        }
+        hash = RotateLeft64(hash ^ (word * prime2), 31) * prime1;
+    }
+    uint64_t tail = 0;
+    for (size_t j = size; j > i; j--) {
+        tail = (tail << 8) | data[j - 1];
+    }
+    hash = RotateLeft64(hash ^ (tail * prime2), 31) * prime1;
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+// Reads a whole file into the arena, for asset data that stays until the
+// next parse or rebuild
+ByteView RomContext::ReadArenaFile(const std::string& path)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        throw RomError("Failed to open " + path + " for reading.");
+    }
+    fseek(file, 0, SEEK_END);
+    size_t size = ftell(file);
+    uint8_t* data = arena.Allocate(size);
+    fseek(file, 0, SEEK_SET);
+    size = fread(data, 1, size, file);
+    fclose(file);
+    return ByteView(data, size);
+}
+
+void RomContext::LoadROM(std::string path)
+{
+    ReadWholeFile(path, rom_data);
+    if (ReadRom32(0) != 0x80371240) {
+        throw RomError("File " + path + " is not a valid N64 ROM.");
+    }
+}
+
+bool CompareSegRefs(SegRef& a, SegRef& b)
+{
+    return a.segname < b.segname;
+}
+
+void ParseSegRefsGameDesc(GameData& desc, tinyxml2::XMLElement* segrefs)
+{
+    tinyxml2::XMLElement* segref_elem;
+    if (!segrefs) {
+        return;
+    }
+    segref_elem = segrefs->FirstChildElement("segref");
+    while (segref_elem) {
+        SegRef segref;
+        const char* segname_value = nullptr;
+        XMLCheck(segref_elem->QueryAttribute("segname", &segname_value));
+        segref.segname = segname_value;
+        XMLCheck(segref_elem->QueryAttribute("hi", &segref.hi));
+        XMLCheck(segref_elem->QueryAttribute("lo", &segref.lo));
+        segref_elem->QueryAttribute("end", &segref.end);
+        desc.segrefs.push_back(segref);
+        segref_elem = segref_elem->NextSiblingElement("segref");
+    }
+    std::sort(desc.segrefs.begin(), desc.segrefs.end(), CompareSegRefs);
+}
+
+bool RomContext::CheckSegRefs()
+{
+    std::string curr_segname;
+    uint32_t last_value = 0;
+    bool is_end = false;
+    for (size_t i = 0; i < gamedata.segrefs.size(); i++) {
+        if (curr_segname != gamedata.segrefs[i].segname || is_end != gamedata.segrefs[i].end) {
+            curr_segname = gamedata.segrefs[i].segname;
+            last_value = gamedata.segrefs[i].value;
+            is_end = gamedata.segrefs[i].end;
+        }
+        else {
+            if (gamedata.segrefs[i].value != last_value) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+uint32_t RomContext::GetSegValue(int segid)
+{
+    const SegRefIndex& index = gamedata.segref_index[segid];
+    if (index.start_refs.empty()) {
+        std::cout << "Segment " << index.segname << " not in segrefs." << std::endl;
+        return 0;
+    }
+    return gamedata.segrefs[index.start_refs[0]].value;
+}
+
+void RomContext::SetSegValue(int segid, uint32_t value, bool end)
+{
+    const SegRefIndex& index = gamedata.segref_index[segid];
+    for (size_t ref : end ? index.end_refs : index.start_refs) {
+        gamedata.segrefs[ref].value = value;
+    }
+}
+
+static void SetIndexName(std::vector<std::string>& names, unsigned int id, const char* name)
+{
+    if (id > UINT16_MAX) {
+        throw RomError("Name id " + std::to_string(id) + " is too large.");
+    }
+    if (id >= names.size()) {
+        names.resize(id + 1);
+    }
+    if (names[id].empty()) {
+        names[id] = name;
+    }
+}
+
+static std::string GetIndexName(const std::vector<std::string>& names, size_t index)
+{
+    if (index < names.size() && !names[index].empty()) {
+        return names[index];
+    }
+    else {
+        return std::to_string(index);
+    }
+}
+
+// Shared by the XML parser and the built-in descriptions
+void AddMessDataGameDesc(GameData& desc, const char* segname, bool use_dirmap)
+{
+    MessDataSegment messdata;
+    messdata.segname = segname;
+    messdata.use_dirmap = use_dirmap;
+    messdata.new_format = desc.game == "mp3";
+    desc.messdata_all.push_back(messdata);
+}
+
+void AddMusBankGameDesc(GameData& desc, const char* segname)
+{
+    MusBankSegment musbank;
+    musbank.segname = segname;
+    musbank.new_format = (desc.game == "mp2" || desc.game == "mp3");
+    if (musbank.new_format) {
+        musbank.revision.push_back(0x4D); // M
+        musbank.revision.push_back(0x42); // B
+        musbank.revision.push_back(0x46); // F
+        musbank.revision.push_back(0x30); // 0
+    }
+    else {
+        musbank.revision.push_back(0x53); // S
+        musbank.revision.push_back(0x32); // 1/2
+    }
+    desc.musbanks.push_back(musbank);
+}
+
+void AddSfxBankGameDesc(GameData& desc, const char* segname)
+{
+    SfxBankSegment sfxbank;
+    sfxbank.segname = segname;
+    sfxbank.new_format = (desc.game == "mp2" || desc.game == "mp3");
+    desc.sfxbanks.push_back(sfxbank);
+}
+
+void ParseFileGameDesc(GameData& desc, tinyxml2::XMLElement* element)
+{
+    if (!element) {
+        throw RomError("Missing file data element.");
+    }
+    const char* segname_value = nullptr;
+    XMLCheck(element->QueryAttribute("segname", &segname_value));
+    desc.filedata.segname = segname_value;
+    tinyxml2::XMLElement* child_elem = element->FirstChildElement("datadir");
+    while (child_elem) {
+        unsigned int id = 0;
+        const char* name = nullptr;
+        XMLCheck(child_elem->QueryAttribute("id", &id));
+        XMLCheck(child_elem->QueryAttribute("name", &name));
+        SetIndexName(desc.filedata.datadir_names, id, name);
+        child_elem = child_elem->NextSiblingElement("datadir");
+    }
+}
+
+void ParseMessDataRomGameDesc(GameData& desc, tinyxml2::XMLElement* element)
+{
+    if (!element) {
+        return;
+    }
+    const char* segname_value = nullptr;
+    bool use_dirmap = false;
+    XMLCheck(element->QueryAttribute("segname", &segname_value));
+    element->QueryAttribute("use_dirmap", &use_dirmap);
+    AddMessDataGameDesc(desc, segname_value, use_dirmap);
+}
+
+void ParseMessDataRomDirMap(GameData& desc, tinyxml2::XMLElement* element)
+{
+    if (!element) {
+        return;
+    }
+    if (desc.game != "mp3") {
+        throw RomError("Message Data Directory Map should only be present in Mario Party 3.");
+    }
+    tinyxml2::XMLElement* child_elem = element->FirstChildElement("messdir");
+    while (child_elem) {
+        unsigned int id = 0;
+        const char* name = nullptr;
+        XMLCheck(child_elem->QueryAttribute("id", &id));
+        XMLCheck(child_elem->QueryAttribute("name", &name));
+        SetIndexName(desc.messdir_names, id, name);
+        child_elem = child_elem->NextSiblingElement("messdir");
+    }
+}
+
+void ParseHvqDataRomGameDesc(GameData& desc, tinyxml2::XMLElement* element)
+{
+    if (!element) {
+        throw RomError("Missing HVQ data element.");
+    }
+    const char* segname_value = nullptr;
+    XMLCheck(element->QueryAttribute("segname", &segname_value));
+    desc.hvqdata.segname = segname_value;
+    tinyxml2::XMLElement* child_elem = element->FirstChildElement("hvqbg");
+    while (child_elem) {
+        unsigned int id = 0;
+        const char* name = nullptr;
+        XMLCheck(child_elem->QueryAttribute("id", &id));
+        XMLCheck(child_elem->QueryAttribute("name", &name));
+        SetIndexName(desc.hvqdata.hvqbg_names, id, name);
+        child_elem = child_elem->NextSiblingElement("hvqbg");
+    }
+}
+
+void ParseBgAnimDataRomGameDesc(GameData& desc, tinyxml2::XMLElement* element)
+{
+    if (!element) {
+        if (desc.game == "mp2") {
+            throw RomError("Missing Background Animation data element.");
+        }
+        return;
+    }
+    const char* segname_value = nullptr;
+    XMLCheck(element->QueryAttribute("segname", &segname_value));
+    desc.bganimdata.segname = segname_value;
+    tinyxml2::XMLElement* child_elem = element->FirstChildElement("bganim");
+    while (child_elem) {
+        unsigned int id = 0;
+        const char* name = nullptr;
+        XMLCheck(child_elem->QueryAttribute("id", &id));
+        XMLCheck(child_elem->QueryAttribute("name", &name));
+        SetIndexName(desc.bganimdata.bganim_names, id, name);
+        child_elem = child_elem->NextSiblingElement("bganim");
+    }
+}
+
+void ParseMusBankGameDesc(GameData& desc, tinyxml2::XMLElement* element)
+{
+    if (!element) {
+        return;
+    }
+    const char* segname_value = nullptr;
+    XMLCheck(element->QueryAttribute("segname", &segname_value));
+    AddMusBankGameDesc(desc, segname_value);
+}
+
+void ParseSfxBankGameDesc(GameData& desc, tinyxml2::XMLElement* element)
+{
+    if (!element) {
+        return;
+    }
+    const char* segname_value = nullptr;
+    XMLCheck(element->QueryAttribute("segname", &segname_value));
+    AddSfxBankGameDesc(desc, segname_value);
+}
+
+void ParseFXDataRomGameDesc(GameData& desc, tinyxml2::XMLElement* element)
+{
+    if (!element) {
+        throw RomError("Missing FX Data Element.");
+    }
+    const char* segname_value = nullptr;
+    XMLCheck(element->QueryAttribute("segname", &segname_value));
+    desc.fxdata.segname = segname_value;
+}
+
+// Give every segment an id with its references listed up front, so
+// resolving and rewriting segment addresses never searches by name
+void IndexGameDesc(GameData& desc)
+{
+    std::map<std::string, int> segids;
+    auto get_segid = [&desc, &segids](const std::string& segname) {
+        auto it = segids.find(segname);
+        if (it != segids.end()) {
+            return it->second;
+        }
+        int segid = desc.segref_index.size();
+        SegRefIndex index;
+        index.segname = segname;
+        desc.segref_index.push_back(std::move(index));
+        segids[segname] = segid;
+        return segid;
+    };
+    for (size_t i = 0; i < desc.segrefs.size(); i++) {
+        SegRefIndex& index = desc.segref_index[get_segid(desc.segrefs[i].segname)];
+        if (desc.segrefs[i].end) {
+            index.end_refs.push_back(i);
+        }
+        else {
+            index.start_refs.push_back(i);
+        }
+    }
+    desc.filedata.segid = get_segid(desc.filedata.segname);
+    for (auto& messdata : desc.messdata_all) {
+        messdata.segid = get_segid(messdata.segname);
+    }
+    desc.hvqdata.segid = get_segid(desc.hvqdata.segname);
+    if (!desc.bganimdata.segname.empty()) {
+        desc.bganimdata.segid = get_segid(desc.bganimdata.segname);
+    }
+    for (auto& musbank : desc.musbanks) {
+        musbank.segid = get_segid(musbank.segname);
+    }
+    for (auto& sfxbank : desc.sfxbanks) {
+        sfxbank.segid = get_segid(sfxbank.segname);
+    }
+    desc.fxdata.segid = get_segid(desc.fxdata.segname);
+}
+
+void ParseGameDesc(GameData& desc, tinyxml2::XMLElement* root)
+{
+    const char* game_name_value = nullptr;
+    XMLCheck(root->QueryAttribute("game", &game_name_value));
+    desc.game = game_name_value;
+    ParseSegRefsGameDesc(desc, root->FirstChildElement("segrefs"));
+    ParseFileGameDesc(desc, root->FirstChildElement("filedata"));
+    tinyxml2::XMLElement* element = root->FirstChildElement("messdata");
+    while (element) {
+        ParseMessDataRomGameDesc(desc, element);
+        element = element->NextSiblingElement("messdata");
+    }
+    if (desc.messdata_all.size() == 0) {
+        throw RomError("No Message Data Elements.");
+    }
+    ParseMessDataRomDirMap(desc, root->FirstChildElement("messdir_map"));
+    ParseHvqDataRomGameDesc(desc, root->FirstChildElement("hvqdata"));
+    ParseBgAnimDataRomGameDesc(desc, root->FirstChildElement("bganimdata"));
+    element = root->FirstChildElement("musbank");
+    while (element) {
+        ParseMusBankGameDesc(desc, element);
+        element = element->NextSiblingElement("musbank");
+    }
+    if (desc.musbanks.size() == 0) {
+        throw RomError("No Music Bank Elements.");
+    }
+    element = root->FirstChildElement("sfxbank");
+    while (element) {
+        ParseSfxBankGameDesc(desc, element);
+        element = element->NextSiblingElement("sfxbank");
+    }
+    if (desc.sfxbanks.size() == 0) {
+        throw RomError("No Sound Effect Bank Elements.");
+    }
+    ParseFXDataRomGameDesc(desc, root->FirstChildElement("fxdata"));
+    IndexGameDesc(desc);
+}
+
+struct BuiltinSegRef {
+    const char* segname;
+    unsigned int hi;
+    unsigned int lo;
+    bool end;
+};
+
+struct BuiltinName {
+    unsigned int id;
+    const char* name;
+};
+
+struct BuiltinMessData {
+    const char* segname;
+    bool use_dirmap;
+};
+
+struct BuiltinGameDesc {
+    const char* gameid;
+    const char* game;
+    const BuiltinSegRef* segrefs;
+    size_t num_segrefs;
+    const char* filedata_segname;
+    const BuiltinName* datadirs;
+    size_t num_datadirs;
+    const BuiltinMessData* messdata;
+    size_t num_messdata;
+    const BuiltinName* messdirs;
+    size_t num_messdirs;
+    const char* hvqdata_segname;
+    const BuiltinName* hvqbgs;
+    size_t num_hvqbgs;
+    const char* bganimdata_segname;
+    const BuiltinName* bganims;
+    size_t num_bganims;
+    const char* const* musbanks;
+    size_t num_musbanks;
+    const char* const* sfxbanks;
+    size_t num_sfxbanks;
+    const char* fxdata_segname;
+};
+
+#define BUILTIN_ARRAY(A) A, sizeof(A) / sizeof(A[0])
+#include "gamedesc.inc"
+
+void BuildGameDesc(GameData& desc, const BuiltinGameDesc& builtin)
+{
+    desc.game = builtin.game;
+    for (size_t i = 0; i < builtin.num_segrefs; i++) {
+        SegRef segref;
+        segref.segname = builtin.segrefs[i].segname;
+        segref.hi = builtin.segrefs[i].hi;
+        segref.lo = builtin.segrefs[i].lo;
+        segref.end = builtin.segrefs[i].end;
+        desc.segrefs.push_back(segref);
+    }
+    std::sort(desc.segrefs.begin(), desc.segrefs.end(), CompareSegRefs);
+    desc.filedata.segname = builtin.filedata_segname;
+    for (size_t i = 0; i < builtin.num_datadirs; i++) {
+        SetIndexName(desc.filedata.datadir_names, builtin.datadirs[i].id, builtin.datadirs[i].name);
+    }
+    for (size_t i = 0; i < builtin.num_messdata; i++) {
+        AddMessDataGameDesc(desc, builtin.messdata[i].segname, builtin.messdata[i].use_dirmap);
+    }
+    for (size_t i = 0; i < builtin.num_messdirs; i++) {
+        SetIndexName(desc.messdir_names, builtin.messdirs[i].id, builtin.messdirs[i].name);
+    }
+    desc.hvqdata.segname = builtin.hvqdata_segname;
+    for (size_t i = 0; i < builtin.num_hvqbgs; i++) {
+        SetIndexName(desc.hvqdata.hvqbg_names, builtin.hvqbgs[i].id, builtin.hvqbgs[i].name);
+    }
+    desc.bganimdata.segname = builtin.bganimdata_segname;
+    for (size_t i = 0; i < builtin.num_bganims; i++) {
+        SetIndexName(desc.bganimdata.bganim_names, builtin.bganims[i].id, builtin.bganims[i].name);
+    }
+    for (size_t i = 0; i < builtin.num_musbanks; i++) {
+        AddMusBankGameDesc(desc, builtin.musbanks[i]);
+    }
+    for (size_t i = 0; i < builtin.num_sfxbanks; i++) {
+        AddSfxBankGameDesc(desc, builtin.sfxbanks[i]);
+    }
+    desc.fxdata.segname = builtin.fxdata_segname;
+    IndexGameDesc(desc);
+}
+
+std::shared_ptr<const GameData> GameDescCache::GetBuiltin(const std::string& gameid)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string key = "builtin:" + gameid;
+    auto it = descs.find(key);
+    if (it != descs.end()) {
+        return it->second;
+    }
+    for (const BuiltinGameDesc& builtin : builtin_gamedescs) {
+        if (gameid == builtin.gameid) {
+            std::shared_ptr<GameData> desc = std::make_shared<GameData>();
+            BuildGameDesc(*desc, builtin);
+            descs[key] = desc;
+            return desc;
+        }
+    }
+    return nullptr;
+}
+
+std::shared_ptr<const GameData> GameDescCache::Get(const std::string& desc_file)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = descs.find(desc_file);
+    if (it != descs.end()) {
+        return it->second;
+    }
+    tinyxml2::XMLDocument document;
+    if (document.LoadFile(desc_file.c_str()) != tinyxml2::XML_SUCCESS) {
+        return nullptr;
+    }
+    tinyxml2::XMLElement* root = document.FirstChildElement("gamedesc");
+    if (!root) {
+        throw RomError("Invalid Game Desription file.");
+    }
+    std::shared_ptr<GameData> desc = std::make_shared<GameData>();
+    ParseGameDesc(*desc, root);
+    descs[desc_file] = desc;
+    return desc;
+}
+
+// Fill in the ROM addresses of the description's segments from this ROM's segment references
+void RomContext::ResolveGameDesc()
+{
+    game_id = gamedata.game;
+    for (auto& segref : gamedata.segrefs) {
+        uint16_t value_hi = ReadRom16(segref.hi);
+        int16_t value_lo = ReadRom16(segref.lo);
+        segref.value = (value_hi << 16) + value_lo;
+    }
+    if (!CheckSegRefs()) {
+        throw RomError("Invalid segment references");
+    }
+    gamedata.filedata.romaddr = GetSegValue(gamedata.filedata.segid);
+    for (auto& messdata : gamedata.messdata_all) {
+        messdata.romaddr = GetSegValue(messdata.segid);
+    }
+    gamedata.hvqdata.romaddr = GetSegValue(gamedata.hvqdata.segid);
+    if (!gamedata.bganimdata.segname.empty()) {
+        gamedata.bganimdata.romaddr = GetSegValue(gamedata.bganimdata.segid);
+    }
+    for (auto& musbank : gamedata.musbanks) {
+        musbank.romaddr = GetSegValue(musbank.segid);
+    }
+    for (auto& sfxbank : gamedata.sfxbanks) {
+        sfxbank.romaddr = GetSegValue(sfxbank.segid);
+    }
+    gamedata.fxdata.romaddr = GetSegValue(gamedata.fxdata.segid);
+}
+
+void RomContext::ReadGameDesc(std::string gameid)
+{
+    // Description files in desc_path override the built-in descriptions
+    if (!desc_path.empty()) {
+        desc = desc_cache.Get(desc_path + "/game_" + gameid + ".xml");
+    }
+    if (!desc) {
+        desc = desc_cache.GetBuiltin(gameid);
+    }
+    if (!desc) {
+        throw RomError("Failed to load Game Description file for game ID " + gameid);
+    }
+    ResetGameData();
+}
+
+// Start over from the cached description so parse and rebuild can be repeated
+void RomContext::ResetGameData()
+{
+    if (!desc) {
+        throw RomError("No ROM loaded.");
+    }
+    gamedata = *desc;
+    arena.Clear();
+    decode_cache.Clear();
+    ResolveGameDesc();
+    rom_parsed = false;
+}
+
+size_t RomContext::DecodeNone(size_t offset, size_t raw_size, uint8_t* dst)
+{
+    size_t offset_start = offset;
+    for (size_t i = 0; i < raw_size; i++) {
+        *dst++ = ReadRom8(offset++);
+    }
+    return offset - offset_start;
+}
+
+// Number of consecutive set bits from the top of value
+static inline uint32_t CountLeadingOnes(uint32_t value)
+{
+#if defined(_WIN32)
+    unsigned long index;
+    return _BitScanReverse(&index, ~value) ? 31 - index : 32;
+#else
+    return ~value ? __builtin_clz(~value) : 32;
+#endif
+}
+
+// Copies len bytes from dist bytes back in the output, where anything before
+// the start of the output reads as zero
+static inline void CopyBackReference(uint8_t* dst, size_t dst_size, size_t pos, size_t dist, size_t len)
+{
+    uint8_t* out = dst + pos;
+    if (dist >= 8 && dist <= pos && dst_size - pos >= len + 7) {
+        // Whole eight-byte chunks, which may run past len into bytes that are
+        // written later anyway
+        const uint8_t* from = out - dist;
+        uint8_t* end = out + len;
+        do {
+            memcpy(out, from, 8);
+            out += 8;
+            from += 8;
+        } while (out < end);
+        return;
+    }
+    if (dist > pos) {
+        size_t zeros = std::min(len, dist - pos);
+        memset(out, 0, zeros);
+        out += zeros;
+        len -= zeros;
+    }
+    const uint8_t* from = out - dist;
+    if (dist >= 8) {
+        // Eight bytes at a time never reads past what has been written
+        while (len >= 8) {
+            memcpy(out, from, 8);
+            out += 8;
+            from += 8;
+            len -= 8;
+        }
+    }
+    while (len > 0) {
+        *out++ = *from++;
+        len--;
+    }
+}
+
+size_t RomContext::DecodeLZ(size_t offset, size_t raw_size, uint8_t* dst)
+{
+    // The 1024-byte window only ever holds the most recent output, so references
+    // are copied straight from earlier in the output. Window slots that have not
+    // been written yet (output starts at slot 958) read as zero.
+    size_t offset_start = offset;
+    uint16_t flag = 0;
+    size_t pos = 0;
+    while (pos < raw_size) {
+        flag >>= 1;
+        if (!(flag & 0x100)) {
+            flag = 0xFF00 | ReadRom8(offset++);
+        }
+        if (flag & 0x1) {
+            dst[pos++] = ReadRom8(offset++);
+        }
+        else {
+            uint8_t byte1 = ReadRom8(offset++);
+            uint8_t byte2 = ReadRom8(offset++);
+            size_t ofs = ((byte2 & 0xC0) << 2) | byte1;
+            size_t copy_len = std::min<size_t>((byte2 & 0x3F) + 3, raw_size - pos);
+            size_t dist = (pos + LZ_WINDOW_SIZE + LZ_WINDOW_OFS - ofs) % LZ_WINDOW_SIZE;
+            if (dist == 0) {
+                dist = LZ_WINDOW_SIZE;
+            }
+            CopyBackReference(dst, raw_size, pos, dist, copy_len);
+            pos += copy_len;
+        }
+    }
+    return offset - offset_start;
+}
+
+size_t RomContext::DecodeSlide(size_t offset, size_t raw_size, uint8_t* dst)
+{
+    size_t offset_start = offset;
+    offset += 4;
+    uint32_t num_bits = 0;
+    uint32_t mask = 0;
+    size_t pos = 0;
+    while (pos < raw_size) {
+        if (num_bits == 0) {
+            mask = ReadRom32(offset);
+            offset += 4;
+            num_bits = 32;
+        }
+        if (mask & 0x80000000) {
+            // Consecutive literal flags are copied as one run
+            uint32_t run = std::min(CountLeadingOnes(mask), num_bits);
+            size_t copy_len = std::min<size_t>(run, raw_size - pos);
+            if (copy_len <= 8 && offset + 8 <= rom_data.size() && raw_size - pos >= 8) {
+                // Short runs copy a whole eight bytes; the excess is overwritten next
+                memcpy(dst + pos, &rom_data[offset], 8);
+                offset += copy_len;
+            }
+            else if (offset + copy_len <= rom_data.size()) {
+                memcpy(dst + pos, &rom_data[offset], copy_len);
+                offset += copy_len;
+            }
+            else {
+                for (size_t i = 0; i < copy_len; i++) {
+                    dst[pos + i] = ReadRom8(offset++);
+                }
+            }
+            pos += copy_len;
+            mask = run < 32 ? mask << run : 0;
+            num_bits -= run;
+        }
+        else {
+            uint32_t copy_ofs = ReadRom16(offset);
+            size_t copy_len = (copy_ofs & 0xF000) >> 12;
+            size_t dist = (copy_ofs & 0xFFF) + 1;
+            offset += 2;
+            if (copy_len == 0) {
+                copy_len = ReadRom8(offset++) + 18;
+            }
+            else {
+                copy_len += 2;
+            }
+            copy_len = std::min<size_t>(copy_len, raw_size - pos);
+            CopyBackReference(dst, raw_size, pos, dist, copy_len);
+            pos += copy_len;
+            mask <<= 1;
+            num_bits--;
+        }
+    }
+    return offset - offset_start;
+}
+
+size_t RomContext::DecodeRle(size_t offset, size_t raw_size, uint8_t* dst)
+{
+    size_t offset_start = offset;
+    while (raw_size > 0) {
+        if (offset >= rom_data.size()) {
+            // Zero-length runs read from past the end would never finish
+            throw RomError("RLE data runs past the end of the ROM.");
+        }
+        uint8_t len_value = ReadRom8(offset++);
+        if (len_value < 128) {
+            uint8_t value = ReadRom8(offset++);
+            len_value = std::min<size_t>(len_value, raw_size);
+            for (uint8_t i = 0; i < len_value; i++) {
+                *dst++ = value;
+            }
+        }
+        else {
+            len_value = std::min<size_t>(len_value - 128, raw_size);
+            for (uint8_t i = 0; i < len_value; i++) {
+                *dst++ = ReadRom8(offset++);
+            }
+        }
+        raw_size -= len_value;
+    }
+    return offset - offset_start;
+}
+
+// Decodes the entry at offset into dst, which must hold its raw size, and
+// returns the size of the entry in ROM including its header
+size_t RomContext::DecodeEntry(size_t offset, uint8_t* dst)
+{
+    size_t raw_size = ReadRom32(offset);
+    size_t comptype = ReadRom32(offset + 4);
+    size_t comp_size = 0;
+    offset += 8;
+    switch (comptype) {
+    case 0:
+        comp_size = DecodeNone(offset, raw_size, dst);
+        break;
+
+    case 1:
+        comp_size = DecodeLZ(offset, raw_size, dst);
+        break;
+
+    case 2:
+        comp_size = DecodeSlide(offset, raw_size, dst);
+        break;
+
+    case 3:
+    case 4:
+        comp_size = DecodeSlide(offset, raw_size, dst);
+        break;
+
+    case 5:
+        comp_size = DecodeRle(offset, raw_size, dst);
+        break;
+
+    default:
+        throw RomError("Unsupported decode type " + std::to_string(comptype) + ".");
+        break;
+    }
+    if (comp_size % 2 != 0) {
+        comp_size++;
+    }
+    return comp_size + 8;
+}
+
+size_t RomContext::DecodeData(size_t offset, ByteView& data)
+{
+    size_t raw_size = ReadRom32(offset);
+    size_t comptype = ReadRom32(offset + 4);
+    if (comptype == 0 && offset + 8 <= rom_data.size() && raw_size <= rom_data.size() - offset - 8) {
+        // Stored entries are used in place
+        data = ByteView(rom_data.data() + offset + 8, raw_size);
+        return BIT_ALIGN(raw_size, 2) + 8;
+    }
+    // Every byte is written by the decoder, so the block is not cleared first
+    uint8_t* dst = arena.Allocate(raw_size);
+    size_t size = DecodeEntry(offset, dst);
+    data = ByteView(dst, raw_size);
+    return size;
+}
+
+// Compressed file data is decoded on first use and kept in the decode cache
+// unless the caller is a single pass over every file
+DecodedData RomContext::LoadFileData(const FileData& file, bool keep)
+{
+    DecodedData decoded;
+    if (file.romaddr == 0) {
+        decoded.data = file.data;
+        return decoded;
+    }
+    uint32_t key = ((uint32_t)file.dir << 16) | file.file;
+    if (decode_cache.Find(key, decoded)) {
+        return decoded;
+    }
+    std::shared_ptr<uint8_t> buffer(new uint8_t[file.raw_size], std::default_delete<uint8_t[]>());
+    DecodeEntry(file.romaddr, buffer.get());
+    decoded.owner = buffer;
+    decoded.data = ByteView(buffer.get(), file.raw_size);
+    if (keep) {
+        decode_cache.Insert(key, decoded, decode_cache_limit);
+    }
+    return decoded;
+}
+
+StreamDecoder::StreamDecoder(const uint8_t* src, size_t src_size, size_t offset)
+    : src(src), src_size(src_size), src_ofs(offset)
+{
+    raw_size = ReadSrc8() << 24;
+    raw_size |= ReadSrc8() << 16;
+    raw_size |= ReadSrc8() << 8;
+    raw_size |= ReadSrc8();
+    comp_type = ReadSrc8() << 24;
+    comp_type |= ReadSrc8() << 16;
+    comp_type |= ReadSrc8() << 8;
+    comp_type |= ReadSrc8();
+    src_start = src_ofs;
+    raw_remaining = raw_size;
+    switch (comp_type) {
+    case 0:
+    case 5:
+        break;
+
+    case 1:
+        window.resize(1024, 0);
+        break;
+
+    case 2:
+    case 3:
+    case 4:
+        window.resize(4096, 0);
+        src_ofs += 4;
+        break;
+
+    default:
+        throw RomError("Unsupported decode type " + std::to_string(comp_type) + ".");
+        break;
+    }
+}
+
+size_t StreamDecoder::GetCompSize() const
+{
+    size_t comp_size = src_ofs - src_start;
+    if (comp_size % 2 != 0) {
+        comp_size++;
+    }
+    return comp_size + 8;
+}
+
+size_t StreamDecoder::DecodeSome(uint8_t* out, size_t max_bytes)
+{
+    max_bytes = std::min(max_bytes, raw_remaining);
+    size_t size;
+    switch (comp_type) {
+    case 0:
+        for (size = 0; size < max_bytes; size++) {
+            out[size] = ReadSrc8();
+        }
+        break;
+
+    case 1:
+        size = DecodeSomeLZ(out, max_bytes);
+        break;
+
+    case 5:
+        size = DecodeSomeRle(out, max_bytes);
+        break;
+
+    default:
+        size = DecodeSomeSlide(out, max_bytes);
+        break;
+    }
+    raw_remaining -= size;
+    produced += size;
+    return size;
+}
+
+size_t StreamDecoder::DecodeSomeLZ(uint8_t* out, size_t max_bytes)
+{
+    size_t size = 0;
+    while (size < max_bytes) {
+        if (copy_remaining == 0) {
+            mask >>= 1;
+            if (!(mask & 0x100)) {
+                mask = 0xFF00 | ReadSrc8();
+            }
+            if (mask & 0x1) {
+                window[window_ofs++] = out[size++] = ReadSrc8();
+                window_ofs %= 1024;
+                continue;
+            }
+            uint8_t byte1 = ReadSrc8();
+            uint8_t byte2 = ReadSrc8();
+            copy_ofs = ((byte2 & 0xC0) << 2) | byte1;
+            copy_remaining = std::min<size_t>((byte2 & 0x3F) + 3, raw_remaining - size);
+        }
+        while (copy_remaining != 0 && size < max_bytes) {
+            window[window_ofs++] = out[size++] = window[copy_ofs++ % 1024];
+            window_ofs %= 1024;
+            copy_remaining--;
+        }
+    }
+    return size;
+}
+
+size_t StreamDecoder::DecodeSomeSlide(uint8_t* out, size_t max_bytes)
+{
+    size_t size = 0;
+    while (size < max_bytes) {
+        if (copy_remaining == 0) {
+            if (num_bits == 0) {
+                mask = ReadSrc8() << 24;
+                mask |= ReadSrc8() << 16;
+                mask |= ReadSrc8() << 8;
+                mask |= ReadSrc8();
+                num_bits = 32;
+            }
+            bool literal = (mask & 0x80000000) != 0;
+            mask <<= 1;
+            num_bits--;
+            if (literal) {
+                uint8_t value = ReadSrc8();
+                window[(produced + size) % 4096] = value;
+                out[size++] = value;
+                continue;
+            }
+            uint8_t byte1 = ReadSrc8();
+            uint8_t byte2 = ReadSrc8();
+            size_t copy_len = byte1 >> 4;
+            copy_ofs = ((byte1 & 0xF) << 8) | byte2;
+            if (copy_len == 0) {
+                copy_len = ReadSrc8() + 18;
+            }
+            else {
+                copy_len += 2;
+            }
+            copy_remaining = std::min(copy_len, raw_remaining - size);
+        }
+        while (copy_remaining != 0 && size < max_bytes) {
+            // Lookback before the start of the data reads as zero
+            size_t pos = produced + size;
+            uint8_t value = pos > copy_ofs ? window[(pos - copy_ofs - 1) % 4096] : 0;
+            window[pos % 4096] = value;
+            out[size++] = value;
+            copy_remaining--;
+        }
+    }
+    return size;
+}
+
+size_t StreamDecoder::DecodeSomeRle(uint8_t* out, size_t max_bytes)
+{
+    size_t size = 0;
+    while (size < max_bytes) {
+        if (copy_remaining == 0) {
+            if (src_ofs >= src_size) {
+                throw RomError("RLE data runs past the end of the ROM.");
+            }
+            uint8_t len_value = ReadSrc8();
+            if (len_value < 128) {
+                copy_literal = false;
+                copy_value = ReadSrc8();
+            }
+            else {
+                copy_literal = true;
+                len_value -= 128;
+            }
+            copy_remaining = std::min<size_t>(len_value, raw_remaining - size);
+        }
+        while (copy_remaining != 0 && size < max_bytes) {
+            out[size++] = copy_literal ? ReadSrc8() : copy_value;
+            copy_remaining--;
+        }
+    }
+    return size;
+}
+
+void RomContext::ParseFileDataRom()
+{
+    size_t romaddr_base = gamedata.filedata.romaddr;
+    size_t dircnt = ReadRom32(romaddr_base);
+    gamedata.filedata.files.resize(dircnt);
+
+    // Only the headers are read here; see LoadFileData
+    for (size_t i = 0; i < dircnt; i++) {
+        size_t diraddr_base = romaddr_base + ReadRom32(romaddr_base + 4 + (i * 4));
+        size_t filecnt = ReadRom32(diraddr_base);
+        gamedata.filedata.files[i].resize(filecnt);
+
+        for (size_t j = 0; j < filecnt; j++) {
+            FileData& filedata = gamedata.filedata.files[i][j];
+            size_t file_ofs = diraddr_base + ReadRom32(diraddr_base + 4 + (j * 4));
+            filedata.dir = i;
+            filedata.file = j;
+            filedata.raw_size = ReadRom32(file_ofs);
+            filedata.comp_type = ReadRom32(file_ofs + 4);
+            if (filedata.comp_type == 0) {
+                // Stored entries are viewed in place at no cost
+                DecodeData(file_ofs, filedata.data);
+            }
+            else {
+                filedata.romaddr = file_ofs;
+            }
+        }
+    }
+}
+
+void RomContext::ParseMessDataRom(MessDataSegment& messdata)
+{
+    if (messdata.new_format) {
+        size_t dircnt = ReadRom32(messdata.romaddr);
+        messdata.mess_dir_all.resize(dircnt);
+
+        // Parallel processing of message directories
+        TaskGroup group(pool);
+
+        for (size_t i = 0; i < dircnt; i++) {
+            group.Run([this, &messdata, i]() {
+                size_t dir_ofs = messdata.romaddr + ReadRom32(messdata.romaddr + (i * 4) + 4);
+                MessDataDir dir;
+                dir.id = i;
+                DecodeData(dir_ofs, dir.data);
+                messdata.mess_dir_all[i] = std::move(dir);
+                });
+        }
+
+        // Wait for all tasks to complete
+        group.Wait();
+    }
+    else {
+        size_t messcnt = ReadRom32(messdata.romaddr);
+        size_t last_mess_ofs = ReadRom32(messdata.romaddr + ((messcnt - 1) * 4) + 4);
+        uint16_t last_mess_size = ReadRom16(messdata.romaddr + last_mess_ofs) + 2;
+        size_t total_size = last_mess_ofs + last_mess_size;
+        if (total_size % 2 != 0) {
+            total_size++;
+        }
+        messdata.full_data = GetRomView(messdata.romaddr, total_size);
+    }
+}
+
+void RomContext::ParseHvqDataRom()
+{
+    size_t romaddr_base = gamedata.hvqdata.romaddr;
+    size_t dircnt = ReadRom32(romaddr_base);
+    gamedata.hvqdata.hvq_data.resize(dircnt - 1);
+
+    // Backgrounds are stored as is, so they are viewed in place
+    for (size_t i = 0; i < dircnt - 1; i++) {
+        size_t start_ofs = romaddr_base + ReadRom32(romaddr_base + 4 + (i * 4));
+        size_t end_ofs = romaddr_base + ReadRom32(romaddr_base + 4 + ((i + 1) * 4));
+        gamedata.hvqdata.hvq_data[i] = GetRomView(start_ofs, end_ofs - start_ofs);
+    }
+}
+
+void RomContext::ParseBgAnimDataRom()
+{
+    size_t romaddr_base = gamedata.bganimdata.romaddr;
+    size_t dircnt = ReadRom32(romaddr_base);
+    gamedata.bganimdata.bganim_data.resize(dircnt - 1);
+
+    // Animations are stored as is, so they are viewed in place
+    for (size_t i = 0; i < dircnt - 1; i++) {
+        size_t start_ofs = romaddr_base + ReadRom32(romaddr_base + 4 + (i * 4));
+        size_t end_ofs = romaddr_base + ReadRom32(romaddr_base + 4 + ((i + 1) * 4));
+        gamedata.bganimdata.bganim_data[i] = GetRomView(start_ofs, end_ofs - start_ofs);
+    }
+}
+
+void RomContext::CheckRomRange(size_t offset, size_t size)
+{
+    if (offset > rom_data.size() || size > rom_data.size() - offset) {
+        throw RomError("ROM range " + std::to_string(offset) + "+" + std::to_string(size) + " is out of bounds.");
+    }
+}
+
+ByteView RomContext::GetRomView(size_t offset, size_t size)
+{
+    CheckRomRange(offset, size);
+    return ByteView(rom_data.data() + offset, size);
+}
+
+void RomContext::LibAudioDataRom(LibAudioSegment& libaudioseg) {
+    libaudioseg.soundbankseg.data = GetRomView(libaudioseg.soundbankseg.romaddr, libaudioseg.soundbankseg.size);
+    libaudioseg.wavetableseg.data = GetRomView(libaudioseg.wavetableseg.romaddr, libaudioseg.wavetableseg.size);
+    for (SequenceSegment& seqseg : libaudioseg.seqsegs) {
+        seqseg.data = GetRomView(seqseg.romaddr, seqseg.size);
+    }
+}
+
+uint32_t RomContext::GetSeqCountRom(const MusBankSegment& musbank)
+{
+    if (musbank.new_format) {
+        return ReadRom32(musbank.romaddr + 4);
+    }
+    else {
+        return ReadRom16(musbank.romaddr + 2);
+    }
+}
+
+void RomContext::ReadSeqHeaderRom(const MusBankSegment& musbank, uint32_t count, uint32_t index, SequenceSegment& seqseg)
+{
+    size_t romaddr_base = musbank.romaddr;
+    if (musbank.new_format) {
+        uint32_t seq_offset = ReadRom32(romaddr_base + 72 + index * 16);
+        seqseg.romaddr = romaddr_base + seq_offset;
+        seqseg.size = ReadRom32(romaddr_base + 76 + index * 16);
+        seqseg.unk0 = ReadRom8(romaddr_base + 64 + index * 16);
+        seqseg.unk1 = ReadRom8(romaddr_base + 65 + index * 16);
+        seqseg.bank = ReadRom8(romaddr_base + 66 + index * 16);
+    }
+    else {
+        seqseg.romaddr = romaddr_base + ReadRom32(romaddr_base + 8 * index + 4);
+        seqseg.size = ReadRom32(romaddr_base + 8 * index + 8);
+        seqseg.bank = ReadRom8(romaddr_base + count * 8 + 4 + index * 16);
+    }
+}
+
+void RomContext::ParseMusBankDataRom(MusBankSegment& musbank)
+{
+    size_t romaddr_base = musbank.romaddr;
+    if (musbank.new_format) {
+        musbank.revision.push_back(0x4D); // M
+        musbank.revision.push_back(0x42); // B
+        musbank.revision.push_back(0x46); // F
+        musbank.revision.push_back(0x30); // 0
+        uint32_t count = GetSeqCountRom(musbank);
+        uint32_t tbl_record_ofs = romaddr_base + 64 + (count * 16) + 8;
+        uint32_t snd_record_ofs = romaddr_base + 64 + (count * 16);
+        musbank.libaudioseg.seqsegs.resize(count);
+        uint32_t header_size = (count * 16) + 80;
+
+        for (uint32_t i = 0; i < count; i++) {
+            ReadSeqHeaderRom(musbank, count, i, musbank.libaudioseg.seqsegs[i]);
+        }
+        musbank.libaudioseg.soundbankseg.romaddr = romaddr_base + ReadRom32(snd_record_ofs);
+        musbank.libaudioseg.soundbankseg.size = ReadRom32(snd_record_ofs + 4);
+        musbank.libaudioseg.wavetableseg.romaddr = romaddr_base + ReadRom32(tbl_record_ofs);
+        musbank.libaudioseg.wavetableseg.size = ReadRom32(tbl_record_ofs + 4);
+        // TODO: Parse this global music data. Some of these words may be counts or offsets
+        // that depend on the bank layout; they are copied verbatim and not recomputed on rebuild
+        musbank.unkdata.assign(&rom_data[romaddr_base + 0x8], &rom_data[romaddr_base + 0x40]);
+    }
+    else {
+        musbank.revision.push_back(0x53);      // S
+        musbank.revision.push_back(0x32);      // 1/2
+        uint16_t count = GetSeqCountRom(musbank);
+        uint32_t musheader_size = count * 24 + 4;
+        musheader_size = BIT_ALIGN(musheader_size, 16); // 'FF' padding
+
+        // Get libaudio segments romaddr starts and sizes
+        musbank.libaudioseg.soundbankseg.romaddr = romaddr_base + musheader_size;
+        musbank.libaudioseg.wavetableseg.romaddr = romaddr_base + ReadRom32(romaddr_base + count * 8 + 16);
+        musbank.libaudioseg.soundbankseg.size = musbank.libaudioseg.wavetableseg.romaddr - musbank.libaudioseg.soundbankseg.romaddr;
+        musbank.libaudioseg.seqsegs.resize(count);
+        for (uint32_t i = 0; i < count; i++) {
+            ReadSeqHeaderRom(musbank, count, i, musbank.libaudioseg.seqsegs[i]);
+        }
+        musbank.libaudioseg.wavetableseg.size = musbank.libaudioseg.seqsegs[0].romaddr - musbank.libaudioseg.wavetableseg.romaddr;
+    }
+    LibAudioDataRom(musbank.libaudioseg);
+}
+
+// Sound effect banks end in a table of (offset, size) entry records. The new
+// format has six at a fixed offset, the old one five after its count table.
+static size_t GetSfxBankRecordsOfs(bool new_format, uint16_t count)
+{
+    return new_format ? 68 : 4 + (count * 8);
+}
+
+static size_t GetSfxBankNumRecords(bool new_format)
+{
+    return new_format ? 6 : 5;
+}
+
+// Entries that hold data, in the order they are laid out in the bank
+static std::vector<size_t> GetSfxBankLayout(const SfxBankSegment& sfxbank)
+{
+    std::vector<size_t> order;
+    for (size_t i = 0; i < sfxbank.entries.size(); i++) {
+        if (!sfxbank.entries[i].data.empty()) {
+            order.push_back(i);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [&sfxbank](size_t a, size_t b) {
+        return sfxbank.entries[a].offset < sfxbank.entries[b].offset;
+        });
+    return order;
+}
+
+static uint32_t ReadBuffer32(const uint8_t* data, size_t size, size_t offset)
+{
+    if (offset > size || size - offset < 4) {
+        return 0;
+    }
+    return (data[offset] << 24) | (data[offset + 1] << 16) | (data[offset + 2] << 8) | data[offset + 3];
+}
+
+// The bank ends with whichever entry reaches furthest; unused records are empty
+size_t RomContext::GetSfxBankSizeRom(const SfxBankSegment& sfxbank)
+{
+    size_t romaddr_base = sfxbank.romaddr;
+    uint16_t count = sfxbank.new_format ? 0 : ReadRom16(romaddr_base + 2);
+    size_t records_ofs = GetSfxBankRecordsOfs(sfxbank.new_format, count);
+    size_t num_records = GetSfxBankNumRecords(sfxbank.new_format);
+    size_t size = records_ofs + (num_records * 8);
+    for (size_t i = 0; i < num_records; i++) {
+        size_t file_ofs = ReadRom32(romaddr_base + records_ofs + (i * 8));
+        size_t file_size = ReadRom32(romaddr_base + records_ofs + (i * 8) + 4);
+        if (file_size != 0) {
+            size = std::max(size, file_ofs + file_size);
+        }
+    }
+    return size;
+}
+
+void RomContext::ParseSfxBankData(SfxBankSegment& sfxbank, const uint8_t* data, size_t size)
+{
+    uint16_t count = (sfxbank.new_format || size < 4) ? 0 : (data[2] << 8) | data[3];
+    size_t records_ofs = GetSfxBankRecordsOfs(sfxbank.new_format, count);
+    size_t num_records = GetSfxBankNumRecords(sfxbank.new_format);
+    size_t records_end = records_ofs + (num_records * 8);
+    if (records_end > size) {
+        throw RomError("Sound effect bank " + sfxbank.segname + " is too short for its entry table.");
+    }
+    sfxbank.header = ByteView(data, records_ofs);
+    sfxbank.entries.assign(num_records, SfxBankEntry());
+    for (size_t i = 0; i < num_records; i++) {
+        SfxBankEntry& entry = sfxbank.entries[i];
+        size_t entry_size = ReadBuffer32(data, size, records_ofs + (i * 8) + 4);
+        entry.offset = ReadBuffer32(data, size, records_ofs + (i * 8));
+        if (entry_size == 0) {
+            // Unused records keep whatever offset they had
+            continue;
+        }
+        if (entry.offset > size || entry_size > size - entry.offset) {
+            throw RomError("Sound effect bank " + sfxbank.segname + " entry " + std::to_string(i) + " is out of bounds.");
+        }
+        entry.data = ByteView(data + entry.offset, entry_size);
+    }
+
+    // Keep the bytes in front of each entry so the rebuilt bank matches
+    std::vector<size_t> order = GetSfxBankLayout(sfxbank);
+    size_t end = records_end;
+    for (size_t i : order) {
+        SfxBankEntry& entry = sfxbank.entries[i];
+        if (entry.offset > end) {
+            entry.gap = ByteView(data + end, entry.offset - end);
+        }
+        end = std::max<size_t>(end, entry.offset + entry.data.size());
+    }
+}
+
+void RomContext::ParseSfxBankDataRom(SfxBankSegment& sfxbank)
+{
+    size_t size = GetSfxBankSizeRom(sfxbank);
+    CheckRomRange(sfxbank.romaddr, size);
+    ParseSfxBankData(sfxbank, &rom_data[sfxbank.romaddr], size);
+}
+
+void RomContext::ParseFXData(const uint8_t* data, size_t size)
+{
+    size_t count = ReadBuffer32(data, size, 4);
+    if (size < FXDATA_HEADER_SIZE || count > (size - FXDATA_HEADER_SIZE) / FXDATA_RECORD_SIZE) {
+        throw RomError("FX data is too short for its record count.");
+    }
+    gamedata.fxdata.header = ByteView(data, FXDATA_HEADER_SIZE);
+    gamedata.fxdata.records.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        gamedata.fxdata.records[i] = ByteView(data + FXDATA_HEADER_SIZE + (i * FXDATA_RECORD_SIZE), FXDATA_RECORD_SIZE);
+    }
+}
+
+void RomContext::ParseFXDataRom()
+{
+    size_t romaddr_base = gamedata.fxdata.romaddr;
+    uint32_t count = ReadRom32(romaddr_base + 4);
+    size_t size = (count * FXDATA_RECORD_SIZE) + FXDATA_HEADER_SIZE;
+    CheckRomRange(romaddr_base, size);
+    ParseFXData(&rom_data[romaddr_base], size);
+}
+
+void RomContext::ParseGameDataRom()
+{
+    // File data headers only; the data itself is decoded on demand
+    ParseFileDataRom();
+
+    TaskGroup group(pool);
+
+    // Parse message data segments in parallel
+    for (size_t i = 0; i < gamedata.messdata_all.size(); i++) {
+        group.Run([this, i]() {
+            ParseMessDataRom(gamedata.messdata_all[i]);
+            });
+    }
+
+    // Parse other segments in parallel
+    group.Run([this]() { ParseHvqDataRom(); });
+
+    if (game_id == "mp2") {
+        group.Run([this]() { ParseBgAnimDataRom(); });
+    }
+
+    for (size_t i = 0; i < gamedata.musbanks.size(); i++) {
+        group.Run([this, i]() {
+            ParseMusBankDataRom(gamedata.musbanks[i]);
+            });
+    }
+
+    for (size_t i = 0; i < gamedata.sfxbanks.size(); i++) {
+        group.Run([this, i]() {
+            ParseSfxBankDataRom(gamedata.sfxbanks[i]);
+            });
+    }
+
+    group.Run([this]() { ParseFXDataRom(); });
+
+    // Wait for all tasks to complete
+    group.Wait();
+}
+
+
+// Random access to single assets through the segment offset tables, without parsing the rest of the ROM
+void RomContext::GetFileDataRom(size_t dir, size_t file, const std::function<void(const uint8_t*, size_t)>& writer)
+{
+    if (rom_parsed && dir < gamedata.filedata.files.size() && file < gamedata.filedata.files[dir].size()) {
+        // Repeated requests after a parse are served from the decode cache
+        DecodedData decoded = LoadFileData(gamedata.filedata.files[dir][file]);
+        if (!decoded.data.empty()) {
+            writer(decoded.data.data(), decoded.data.size());
+        }
+        return;
+    }
+    size_t romaddr_base = gamedata.filedata.romaddr;
+    size_t dircnt = ReadRom32(romaddr_base);
+    if (dir >= dircnt) {
+        throw RomError("File data directory " + std::to_string(dir) + " does not exist.");
+    }
+    size_t diraddr_base = romaddr_base + ReadRom32(romaddr_base + 4 + (dir * 4));
+    size_t filecnt = ReadRom32(diraddr_base);
+    if (file >= filecnt) {
+        throw RomError("File " + std::to_string(file) + " does not exist in directory " + std::to_string(dir) + ".");
+    }
+    size_t file_ofs = diraddr_base + ReadRom32(diraddr_base + 4 + (file * 4));
+    StreamDecoder decoder(rom_data.data(), rom_data.size(), file_ofs);
+    std::vector<uint8_t> buffer(std::min<size_t>(decoder.GetRawSize(), 0x10000));
+    size_t size;
+    while ((size = decoder.DecodeSome(buffer.data(), buffer.size())) != 0) {
+        writer(buffer.data(), size);
+    }
+}
+
+void RomContext::GetTableEntryRom(size_t romaddr_base, size_t index, const std::function<void(const uint8_t*, size_t)>& writer)
+{
+    size_t dircnt = ReadRom32(romaddr_base);
+    if (index + 1 >= dircnt) {
+        throw RomError("Entry " + std::to_string(index) + " does not exist.");
+    }
+    size_t start_ofs = romaddr_base + ReadRom32(romaddr_base + 4 + (index * 4));
+    size_t end_ofs = romaddr_base + ReadRom32(romaddr_base + 4 + ((index + 1) * 4));
+    if (end_ofs < start_ofs) {
+        throw RomError("Entry " + std::to_string(index) + " has an invalid size.");
+    }
+    CheckRomRange(start_ofs, end_ofs - start_ofs);
+    writer(&rom_data[start_ofs], end_ofs - start_ofs);
+}
+
+void RomContext::GetSequenceRom(size_t bank, size_t index, const std::function<void(const uint8_t*, size_t)>& writer)
+{
+    if (bank >= gamedata.musbanks.size()) {
+        throw RomError("Music bank " + std::to_string(bank) + " does not exist.");
+    }
+    const MusBankSegment& musbank = gamedata.musbanks[bank];
+    uint32_t count = GetSeqCountRom(musbank);
+    if (index >= count) {
+        throw RomError("Sequence " + std::to_string(index) + " does not exist in music bank " + std::to_string(bank) + ".");
+    }
+    SequenceSegment seqseg;
+    ReadSeqHeaderRom(musbank, count, index, seqseg);
+    CheckRomRange(seqseg.romaddr, seqseg.size);
+    writer(&rom_data[seqseg.romaddr], seqseg.size);
+}
+
+static std::vector<size_t> ParseAssetIndices(const std::string& spec, const std::string& indices, size_t count)
+{
+    std::vector<size_t> values;
+    size_t start = 0;
+    while (true) {
+        size_t end = indices.find('/', start);
+        std::string value = indices.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos) {
+            throw RomError("Invalid asset " + spec + ".");
+        }
+        values.push_back(std::stoul(value));
+        if (end == std::string::npos) {
+            break;
+        }
+        start = end + 1;
+    }
+    if (values.size() != count) {
+        throw RomError("Invalid asset " + spec + ".");
+    }
+    return values;
+}
+
+bool RomContext::GetAsset(std::string spec, std::vector<uint8_t>& data)
+{
+    data.clear();
+    return GetAsset(spec, [&data](const uint8_t* buffer, size_t size) {
+        data.insert(data.end(), buffer, buffer + size);
+        });
+}
+
+bool RomContext::GetAsset(std::string spec, const std::function<void(const uint8_t*, size_t)>& writer)
+{
+    return RunGuarded([this, spec, &writer]() {
+        size_t sep = spec.find(':');
+        std::string type = spec.substr(0, sep);
+        std::string indices = sep == std::string::npos ? "" : spec.substr(sep + 1);
+        if (!desc) {
+            throw RomError("No ROM loaded.");
+        }
+        if (type == "filedata") {
+            std::vector<size_t> values = ParseAssetIndices(spec, indices, 2);
+            GetFileDataRom(values[0], values[1], writer);
+        }
+        else if (type == "hvq") {
+            std::vector<size_t> values = ParseAssetIndices(spec, indices, 1);
+            GetTableEntryRom(gamedata.hvqdata.romaddr, values[0], writer);
+        }
+        else if (type == "bganim" && !gamedata.bganimdata.segname.empty()) {
+            std::vector<size_t> values = ParseAssetIndices(spec, indices, 1);
+            GetTableEntryRom(gamedata.bganimdata.romaddr, values[0], writer);
+        }
+        else if (type == "seq") {
+            std::vector<size_t> values = ParseAssetIndices(spec, indices, 2);
+            GetSequenceRom(values[0], values[1], writer);
+        }
+        else {
+            throw RomError("Unknown asset type " + type + ".");
+        }
+        });
+}
+
+struct DataMagic {
+    const char* extension;
+    size_t offset;
+    size_t size;
+    uint8_t magic[8];
+};
+
+// Checked in order, so longer or more specific magic goes first. Every magic
+// must end within DATA_MAGIC_PREFIX_SIZE bytes.
+static const DataMagic data_magic_table[] = {
+    { ".hmf", 8, 8, { 'H', 'B', 'I', 'N', 'M', 'O', 'D', 'E' } },
+    { ".mot", 0, 4, { 'M', 'T', 'N', 'X' } },
+    { ".skn", 0, 4, { 'M', 'T', 'S', 'K' } },
+    { ".anm", 0, 4, { 0, 0, 0, 32 } },
+    { ".anm", 0, 4, { 0, 0, 0, 27 } },
+    { ".hvq", 0, 4, { 'H', 'V', 'Q', ' ' } },
+    { ".hvq", 4, 4, { 0, 0, 0, 48 } },
+    { ".hvqmps", 0, 4, { 'H', 'V', 'Q', '-' } },
+};
+
+static std::string GetDataExtension(const uint8_t* data, size_t size)
+{
+    for (const DataMagic& entry : data_magic_table) {
+        if (entry.offset + entry.size <= size && memcmp(&data[entry.offset], entry.magic, entry.size) == 0) {
+            return entry.extension;
+        }
+    }
+    return ".bin";
+}
+
+// Decodes only the start of the entry at offset to tell its type
+std::string RomContext::GetDataExtensionRom(size_t offset)
+{
+    uint8_t prefix[DATA_MAGIC_PREFIX_SIZE];
+    StreamDecoder decoder(rom_data.data(), rom_data.size(), offset);
+    size_t size = decoder.DecodeSome(prefix, sizeof(prefix));
+    return GetDataExtension(prefix, size);
+}
+
+// Segments are laid out back to back, so the next segment reference bounds the last entry of a segment
+uint32_t RomContext::GetSegmentEndRom(uint32_t romaddr)
+{
+    uint32_t end = rom_data.size();
+    for (const auto& segref : gamedata.segrefs) {
+        if (segref.value > romaddr && segref.value < end) {
+            end = segref.value;
+        }
+    }
+    return end;
+}
+
+// Inventory from the offset tables and data headers, decoding no more than the
+// first bytes of each filedata entry. ROM sizes of filedata entries include their
+// header and alignment padding.
+void RomContext::ListRom(std::vector<AssetInfo>& assets)
+{
+    assets.clear();
+    size_t romaddr_base = gamedata.filedata.romaddr;
+    size_t dircnt = ReadRom32(romaddr_base);
+    std::vector<uint32_t> offsets;
+    for (size_t i = 0; i < dircnt; i++) {
+        size_t diraddr_base = romaddr_base + ReadRom32(romaddr_base + 4 + (i * 4));
+        size_t filecnt = ReadRom32(diraddr_base);
+        offsets.push_back(diraddr_base);
+        for (size_t j = 0; j < filecnt; j++) {
+            AssetInfo asset;
+            asset.type = "filedata";
+            asset.name = GetDataDirName(i);
+            asset.group = i;
+            asset.index = j;
+            asset.romaddr = diraddr_base + ReadRom32(diraddr_base + 4 + (j * 4));
+            asset.raw_size = ReadRom32(asset.romaddr);
+            asset.comp_type = ReadRom32(asset.romaddr + 4);
+            asset.extension = GetDataExtensionRom(asset.romaddr);
+            offsets.push_back(asset.romaddr);
+            assets.push_back(asset);
+        }
+    }
+    std::sort(offsets.begin(), offsets.end());
+    uint32_t filedata_end = GetSegmentEndRom(romaddr_base);
+    for (auto& asset : assets) {
+        auto next = std::upper_bound(offsets.begin(), offsets.end(), asset.romaddr);
+        uint32_t end = next != offsets.end() ? *next : filedata_end;
+        asset.rom_size = end > asset.romaddr ? end - asset.romaddr : 0;
+    }
+
+    std::vector<std::pair<std::string, uint32_t>> tables = { { "hvq", gamedata.hvqdata.romaddr } };
+    if (!gamedata.bganimdata.segname.empty()) {
+        tables.push_back({ "bganim", gamedata.bganimdata.romaddr });
+    }
+    for (const auto& table : tables) {
+        romaddr_base = table.second;
+        dircnt = ReadRom32(romaddr_base);
+        for (size_t i = 0; i + 1 < dircnt; i++) {
+            AssetInfo asset;
+            asset.type = table.first;
+            asset.name = table.first == "hvq" ? GetHvqBgName(i) : GetBgAnimName(i);
+            asset.index = i;
+            asset.romaddr = romaddr_base + ReadRom32(romaddr_base + 4 + (i * 4));
+            uint32_t end = romaddr_base + ReadRom32(romaddr_base + 4 + ((i + 1) * 4));
+            asset.rom_size = asset.raw_size = end > asset.romaddr ? end - asset.romaddr : 0;
+            assets.push_back(asset);
+        }
+    }
+
+    for (size_t i = 0; i < gamedata.musbanks.size(); i++) {
+        const MusBankSegment& musbank = gamedata.musbanks[i];
+        uint32_t count = GetSeqCountRom(musbank);
+        for (uint32_t j = 0; j < count; j++) {
+            SequenceSegment seqseg;
+            ReadSeqHeaderRom(musbank, count, j, seqseg);
+            AssetInfo asset;
+            asset.type = "seq";
+            asset.name = musbank.segname;
+            asset.group = i;
+            asset.index = j;
+            asset.romaddr = seqseg.romaddr;
+            asset.rom_size = asset.raw_size = seqseg.size;
+            assets.push_back(asset);
+        }
+    }
+
+    for (size_t i = 0; i < gamedata.sfxbanks.size(); i++) {
+        AssetInfo asset;
+        asset.type = "sfxbank";
+        asset.name = gamedata.sfxbanks[i].segname;
+        asset.index = i;
+        asset.romaddr = gamedata.sfxbanks[i].romaddr;
+        asset.rom_size = asset.raw_size = GetSfxBankSizeRom(gamedata.sfxbanks[i]);
+        assets.push_back(asset);
+    }
+}
+
+bool RomContext::GetFileData(size_t dir, size_t file, DecodedData& data)
+{
+    return RunGuarded([this, dir, file, &data]() {
+        if (!rom_parsed) {
+            throw RomError("ROM is not parsed.");
+        }
+        if (dir >= gamedata.filedata.files.size() || file >= gamedata.filedata.files[dir].size()) {
+            throw RomError("File " + std::to_string(file) + " does not exist in directory " + std::to_string(dir) + ".");
+        }
+        data = LoadFileData(gamedata.filedata.files[dir][file]);
+        });
+}
+
+bool RomContext::List(std::vector<AssetInfo>& assets)
+{
+    return RunGuarded([this, &assets]() {
+        if (!desc) {
+            throw RomError("No ROM loaded.");
+        }
+        ListRom(assets);
+        });
+}
+
+std::string RomContext::GetDataDirName(uint16_t index)
+{
+    return GetIndexName(gamedata.filedata.datadir_names, index);
+}
+
+void WriteFileToDiscThread(const std::string& filepath, ByteView data)
+{
+    FILE* out_file = fopen(filepath.c_str(), "wb");
+    if (!out_file) {
+        throw RomError("Failed to open " + filepath + " for writing.");
+    }
+    fwrite(data.data(), 1, data.size(), out_file);
+    fclose(out_file);
+}
+
+#if defined(HAVE_IO_URING)
+// Writes files through io_uring in batches of URING_BATCH_FILES. Each file is
+// an openat/write/close chain linked through a slot of a fixed file table, so
+// a whole batch costs one system call instead of three per file.
+class UringWriter {
+public:
+    ~UringWriter();
+    // False if the kernel does not allow io_uring or cannot open files
+    // straight into the fixed file table, which arrived in Linux 5.15
+    bool Init();
+    void Write(const std::string& path, ByteView data, std::shared_ptr<const void> owner);
+    void Flush();
+
+private:
+    struct PendingFile {
+        std::string path;
+        ByteView data;
+        std::shared_ptr<const void> owner;
+    };
+
+    bool SupportsOps();
+    bool SupportsDirectOpen();
+    void Submit();
+    io_uring_sqe* NextSqe();
+    template <typename Handler>
+    void Enter(size_t count, Handler handle);
+
+    int ring_fd = -1;
+    io_uring_params params = {};
+    void* sq_ring = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    void* cq_ring = MAP_FAILED;
+    size_t cq_ring_size = 0;
+    io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+    size_t sqes_size = 0;
+    std::vector<PendingFile> pending;
+    std::string error;
+};
+
+UringWriter::~UringWriter()
+{
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqes_size);
+    }
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+        munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring != MAP_FAILED) {
+        munmap(sq_ring, sq_ring_size);
+    }
+    if (ring_fd >= 0) {
+        close(ring_fd);
+    }
+}
+
+bool UringWriter::Init()
+{
+    ring_fd = (int)syscall(__NR_io_uring_setup, URING_BATCH_FILES * 4, &params);
+    if (ring_fd < 0) {
+        return false;
+    }
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring = sq_ring;
+    }
+    else {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            return false;
+        }
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    // Empty slots for the files of one batch
+    std::vector<int> slots(URING_BATCH_FILES, -1);
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES, slots.data(), URING_BATCH_FILES) != 0) {
+        return false;
+    }
+    return SupportsOps() && SupportsDirectOpen();
+}
+
+// Kernels without the probe predate the open and close opcodes
+bool UringWriter::SupportsOps()
+{
+    std::vector<uint8_t> buf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+    io_uring_probe* probe = (io_uring_probe*)buf.data();
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) != 0) {
+        return false;
+    }
+    for (uint8_t op : { IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE }) {
+        if (op >= probe->ops_len || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The probe cannot tell whether opens may target a fixed file slot; older
+// kernels refuse file_index with EINVAL, so open and close a directory once
+bool UringWriter::SupportsDirectOpen()
+{
+    io_uring_sqe* sqe = NextSqe();
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)".";
+    sqe->open_flags = O_RDONLY | O_DIRECTORY;
+    sqe->file_index = 1;
+
+    sqe = NextSqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = 1;
+
+    bool supported = true;
+    try {
+        Enter(2, [&supported](const io_uring_cqe& cqe) {
+            if (cqe.res < 0) {
+                supported = false;
+            }
+            });
+    }
+    catch (const RomError&) {
+        return false;
+    }
+    return supported;
+}
+
+void UringWriter::Write(const std::string& path, ByteView data, std::shared_ptr<const void> owner)
+{
+    pending.push_back({ path, data, owner });
+    if (pending.size() == URING_BATCH_FILES) {
+        Submit();
+    }
+}
+
+void UringWriter::Flush()
+{
+    if (!pending.empty()) {
+        Submit();
+    }
+    if (!error.empty()) {
+        std::string message = error;
+        error.clear();
+        throw RomError(message);
+    }
+}
+
+io_uring_sqe* UringWriter::NextSqe()
+{
+    uint32_t* tail = (uint32_t*)((uint8_t*)sq_ring + params.sq_off.tail);
+    uint32_t mask = *(uint32_t*)((uint8_t*)sq_ring + params.sq_off.ring_mask);
+    uint32_t* array = (uint32_t*)((uint8_t*)sq_ring + params.sq_off.array);
+    uint32_t index = *tail & mask;
+    array[index] = index;
+    io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(tail, *tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+// Submits the count queued entries and passes each completion to handle
+template <typename Handler>
+void UringWriter::Enter(size_t count, Handler handle)
+{
+    uint32_t* cq_head = (uint32_t*)((uint8_t*)cq_ring + params.cq_off.head);
+    uint32_t* cq_tail = (uint32_t*)((uint8_t*)cq_ring + params.cq_off.tail);
+    uint32_t cq_mask = *(uint32_t*)((uint8_t*)cq_ring + params.cq_off.ring_mask);
+    io_uring_cqe* cqes = (io_uring_cqe*)((uint8_t*)cq_ring + params.cq_off.cqes);
+    size_t to_submit = count;
+    size_t to_reap = count;
+    while (to_reap > 0) {
+        long ret = syscall(__NR_io_uring_enter, ring_fd, (unsigned int)to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw RomError("io_uring_enter failed: " + std::string(strerror(errno)) + ".");
+        }
+        to_submit -= ret;
+        uint32_t head = *cq_head;
+        uint32_t tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++, to_reap--) {
+            handle(cqes[head & cq_mask]);
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+void UringWriter::Submit()
+{
+    for (size_t i = 0; i < pending.size(); i++) {
+        const PendingFile& file = pending[i];
+        io_uring_sqe* sqe = NextSqe();
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)file.path.c_str();
+        sqe->len = 0666;
+        // Direct descriptors never reach the file table, so O_CLOEXEC is refused
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+        sqe->file_index = (uint32_t)i + 1;
+        sqe->user_data = i * 3;
+
+        sqe = NextSqe();
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->flags = IOSQE_IO_LINK | IOSQE_FIXED_FILE;
+        sqe->fd = (int32_t)i;
+        sqe->addr = (uint64_t)(uintptr_t)file.data.data();
+        sqe->len = (uint32_t)file.data.size();
+        sqe->user_data = i * 3 + 1;
+
+        sqe = NextSqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = (uint32_t)i + 1;
+        sqe->user_data = i * 3 + 2;
+    }
+
+    Enter(pending.size() * 3, [this](const io_uring_cqe& cqe) {
+        const PendingFile& file = pending[cqe.user_data / 3];
+        // Steps after a failed one complete as cancelled; the failure itself is reported
+        if (error.empty() && cqe.res != -ECANCELED) {
+            switch (cqe.user_data % 3) {
+            case 0:
+                if (cqe.res < 0) {
+                    error = "Failed to open " + file.path + " for writing: " + strerror(-cqe.res) + ".";
+                }
+                break;
+
+            case 1:
+                if (cqe.res != (int32_t)file.data.size()) {
+                    error = "Failed to write " + file.path + ".";
+                }
+                break;
+
+            default:
+                if (cqe.res < 0) {
+                    error = "Failed to close " + file.path + ".";
+                }
+                break;
+            }
+        }
+        });
+    pending.clear();
+}
+#endif
+
+// Writes the files of one dump stage with the selected backend. Data must
+// stay alive until Flush, which waits for every write and reports failures,
+// unless its owner is passed along to be held until the file is written.
+class FileWriter {
+public:
+    FileWriter(ThreadPool& pool, WriterBackend backend) : group(pool)
+    {
+#if defined(HAVE_IO_URING)
+        if (backend == WriterBackend::Uring) {
+            uring.reset(new UringWriter());
+            if (!uring->Init()) {
+                uring.reset();
+            }
+        }
+#endif
+    }
+
+    void Write(const std::string& path, ByteView data, std::shared_ptr<const void> owner = nullptr)
+    {
+#if defined(HAVE_IO_URING)
+        if (uring) {
+            uring->Write(path, data, owner);
+            return;
+        }
+#endif
+        group.Run([path, data, owner]() {
+            WriteFileToDiscThread(path, data);
+            });
+    }
+
+    void Flush()
+    {
+#if defined(HAVE_IO_URING)
+        if (uring) {
+            uring->Flush();
+            return;
+        }
+#endif
+        group.Wait();
+    }
+
+private:
+    TaskGroup group;
+#if defined(HAVE_IO_URING)
+    std::unique_ptr<UringWriter> uring;
+#endif
+};
+
+bool IsWriterBackendSupported(WriterBackend backend)
+{
+#if defined(HAVE_IO_URING)
+    if (backend == WriterBackend::Uring) {
+        UringWriter uring;
+        return uring.Init();
+    }
+#endif
+    return backend == WriterBackend::Pool;
+}
+
+void RomContext::DumpFileData(tinyxml2::XMLPrinter& printer, std::string outdir)
+{
+    MakeDirectory(outdir);
+    printer.OpenElement("filedata");
+
+    std::vector<FileData*> files;
+    for (size_t i = 0; i < gamedata.filedata.files.size(); i++) {
+        MakeDirectory(outdir + "/" + GetDataDirName(i));
+        for (FileData& file : gamedata.filedata.files[i]) {
+            files.push_back(&file);
+        }
+    }
+
+    // Files are decoded in parallel a window at a time and handed to the
+    // writer, which holds each one only until it is written. Each file is
+    // used once, so they are not added to the decode cache.
+    FileWriter writer(pool, writer_backend);
+    const size_t files_per_batch = 16;
+    for (size_t start = 0; start < files.size(); start += FILEDATA_DUMP_WINDOW) {
+        size_t end = std::min<size_t>(start + FILEDATA_DUMP_WINDOW, files.size());
+        std::vector<DecodedData> decoded(end - start);
+        TaskGroup group(pool);
+        for (size_t batch = start; batch < end; batch += files_per_batch) {
+            size_t batch_end = std::min(batch + files_per_batch, end);
+            group.Run([this, &files, &decoded, start, batch, batch_end]() {
+                for (size_t i = batch; i < batch_end; i++) {
+                    DecodedData& data = decoded[i - start];
+                    data = LoadFileData(*files[i], false);
+                }
+                });
+        }
+        group.Wait();
+
+        for (size_t i = start; i < end; i++) {
+            FileData& file = *files[i];
+            const DecodedData& data = decoded[i - start];
+            file.stamp.path = outdir + "/" + GetDataDirName(file.dir) + "/" + std::to_string(file.file)
+                + GetDataExtension(data.data.data(), data.data.size());
+            writer.Write(file.stamp.path, data.data, data.owner);
+        }
+    }
+
+    // Wait for all file writes to complete
+    writer.Flush();
+
+    for (auto& dir : gamedata.filedata.files) {
+        printer.OpenElement("datadir");
+        for (FileData& file : dir) {
+            printer.OpenElement("file");
+            printer.PushAttribute("path", file.stamp.path.c_str());
+            printer.PushAttribute("comptype", file.comp_type);
+            printer.CloseElement();
+        }
+        printer.CloseElement();
+    }
+
+    printer.CloseElement();
+}
+
+std::string RomContext::GetMessDirName(size_t index)
+{
+    return GetIndexName(gamedata.messdir_names, index);
+}
+
+void RomContext::DumpMessDataExt(tinyxml2::XMLPrinter& printer, std::string basedir, size_t index)
+{
+    MessDataSegment& messdata = gamedata.messdata_all[index];
+    std::string outdir = basedir + "/" + messdata.segname + "/";
+    MakeDirectory(outdir);
+    printer.OpenElement("messdata");
+    printer.PushAttribute("new_format", true);
+    printer.PushAttribute("segindex", index);
+
+    // Write message files in parallel
+    FileWriter writer(pool, writer_backend);
+
+    for (size_t i = 0; i < messdata.mess_dir_all.size(); i++) {
+        std::string messdir_name = std::to_string(i);
+        if (messdata.use_dirmap) {
+            messdir_name = GetMessDirName(i);
+        }
+        std::string messfile = outdir + messdir_name + ".bin";
+
+        writer.Write(messfile, messdata.mess_dir_all[i].data);
+
+        printer.OpenElement("messdir");
+        printer.PushAttribute("path", messfile.c_str());
+        printer.CloseElement();
+    }
+
+    // Wait for all writes to complete
+    writer.Flush();
+
+    printer.CloseElement();
+}
+
+void RomContext::DumpMessData(tinyxml2::XMLPrinter& printer, std::string basedir, size_t index)
+{
+    MessDataSegment& messdata = gamedata.messdata_all[index];
+    std::string outfile = basedir + "/" + messdata.segname + ".bin";
+    printer.OpenElement("messdata");
+    printer.PushAttribute("new_format", false);
+    printer.PushAttribute("segindex", index);
+    printer.PushAttribute("path", outfile.c_str());
+
+    FileWriter writer(pool, writer_backend);
+    writer.Write(outfile, messdata.full_data);
+    writer.Flush();
+
+    printer.CloseElement();
+}
+
+std::string RomContext::GetHvqBgName(size_t index)
+{
+    return GetIndexName(gamedata.hvqdata.hvqbg_names, index);
+}
+
+void RomContext::DumpHvqData(tinyxml2::XMLPrinter& printer, std::string outdir)
+{
+    MakeDirectory(outdir);
+    printer.OpenElement("hvqdata");
+
+    // Write HVQ files in parallel
+    FileWriter writer(pool, writer_backend);
+
+    for (size_t i = 0; i < gamedata.hvqdata.hvq_data.size(); i++) {
+        std::string hvqfile = outdir + "/" + GetHvqBgName(i) + ".bghvq";
+
+        writer.Write(hvqfile, gamedata.hvqdata.hvq_data[i]);
+
+        printer.OpenElement("hvqbg");
+        printer.PushAttribute("path", hvqfile.c_str());
+        printer.CloseElement();
+    }
+
+    // Wait for all writes to complete
+    writer.Flush();
+
+    printer.CloseElement();
+}
+
+std::string RomContext::GetBgAnimName(size_t index)
+{
+    return GetIndexName(gamedata.bganimdata.bganim_names, index);
+}
+
+void RomContext::DumpBgAnimData(tinyxml2::XMLPrinter& printer, std::string outdir)
+{
+    MakeDirectory(outdir);
+    printer.OpenElement("bganimdata");
+
+    // Write background animation files in parallel
+    FileWriter writer(pool, writer_backend);
+
+    for (size_t i = 0; i < gamedata.bganimdata.bganim_data.size(); i++) {
+        ByteView segment = gamedata.bganimdata.bganim_data[i];
+        std::string bganimfile = outdir + "/" + GetBgAnimName(i) + ".bganm";
+
+        writer.Write(bganimfile, segment);
+
+        printer.OpenElement("bganim");
+        printer.PushAttribute("path", bganimfile.c_str());
+        printer.CloseElement();
+    }
+
+    // Wait for all writes to complete
+    writer.Flush();
+
+    printer.CloseElement();
+}
+
+// Files already written during one extraction, so identical data is stored once
+class SharedDataPaths {
+public:
+    // Returns the path the same data was written to, or an empty string
+    std::string Find(ByteView data, uint64_t hash) const
+    {
+        auto range = paths.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second.first == data) {
+                return it->second.second;
+            }
+        }
+        return "";
+    }
+
+    void Add(ByteView data, uint64_t hash, const std::string& path)
+    {
+        paths.insert({ hash, { data, path } });
+    }
+
+private:
+    std::multimap<uint64_t, std::pair<ByteView, std::string>> paths;
+};
+
+void RomContext::DumpMusBank(tinyxml2::XMLPrinter& printer, std::string basedir, size_t index, SharedDataPaths& shared)
+{
+    MusBankSegment& musbank = gamedata.musbanks[index];
+    std::string dir = basedir + "/" + musbank.segname;
+    std::string seqbasedir = dir + "/seqs";
+    MakeDirectory(basedir);
+    MakeDirectory(dir);
+    MakeDirectory(seqbasedir);
+    printer.OpenElement("musbank");
+    std::string soundbankfile = dir + "/soundbank.ctl";
+    std::string wavetablefile = dir + "/wavetable.tbl";
+    printer.PushAttribute("segindex", index);
+    printer.PushAttribute("new_format", musbank.new_format);
+    std::string unkfile = dir + "/unkdata.bin";
+    if (musbank.new_format) {
+        printer.PushAttribute("unkdata_path", unkfile.c_str());
+    }
+
+    // Write audio files in parallel, reusing files with the same content from this or earlier banks
+    FileWriter writer(pool, writer_backend);
+    auto write_shared = [&writer, &shared](ByteView data, const std::string& path) {
+        uint64_t hash = HashBytes(data);
+        std::string shared_path = shared.Find(data, hash);
+        if (!shared_path.empty()) {
+            return shared_path;
+        }
+        shared.Add(data, hash, path);
+        writer.Write(path, data);
+        return path;
+    };
+
+    printer.OpenElement("soundbank");
+    soundbankfile = write_shared(musbank.libaudioseg.soundbankseg.data, soundbankfile);
+    printer.PushAttribute("path", soundbankfile.c_str());
+    printer.CloseElement();
+
+    printer.OpenElement("wavetable");
+    wavetablefile = write_shared(musbank.libaudioseg.wavetableseg.data, wavetablefile);
+    printer.PushAttribute("path", wavetablefile.c_str());
+    printer.CloseElement();
+
+    printer.OpenElement("seqbank");
+    uint32_t num_files = 0;
+    for (auto& seq : musbank.libaudioseg.seqsegs) {
+        std::string newfile = seqbasedir + "/" + std::to_string(num_files) + ".seq";
+        std::string seqfile = write_shared(seq.data, newfile);
+        if (seqfile == newfile) {
+            num_files++;
+        }
+        printer.OpenElement("seq");
+        printer.PushAttribute("path", seqfile.c_str());
+        printer.PushAttribute("bank", seq.bank);
+        if (musbank.new_format) {
+            printer.PushAttribute("unk0", seq.unk0);
+            printer.PushAttribute("unk1", seq.unk1);
+        }
+        printer.CloseElement();
+    }
+    printer.CloseElement();
+
+    // TODO: Remove and parse this information for new_format
+    if (musbank.new_format) {
+        writer.Write(unkfile, musbank.unkdata);
+    }
+
+    // Wait for all file writes
+    writer.Flush();
+
+    printer.CloseElement();
+}
+
+void RomContext::DumpSfxBank(tinyxml2::XMLPrinter& printer, std::string basedir, size_t index)
+{
+    SfxBankSegment& sfxbank = gamedata.sfxbanks[index];
+    std::string dir = basedir + "/" + sfxbank.segname;
+    std::string headerfile = dir + "/header.bin";
+    MakeDirectory(dir);
+    printer.OpenElement("sfxbank");
+    printer.PushAttribute("header", headerfile.c_str());
+    printer.PushAttribute("segindex", index);
+    printer.PushAttribute("new_format", sfxbank.new_format);
+
+    // Write header and entries in parallel
+    FileWriter writer(pool, writer_backend);
+    writer.Write(headerfile, sfxbank.header);
+    for (size_t i = 0; i < sfxbank.entries.size(); i++) {
+        std::string entryfile = dir + "/" + std::to_string(i) + ".bin";
+        printer.OpenElement("entry");
+        printer.PushAttribute("path", entryfile.c_str());
+        printer.PushAttribute("offset", sfxbank.entries[i].offset);
+        if (!sfxbank.entries[i].gap.empty()) {
+            std::string gapfile = dir + "/" + std::to_string(i) + "_gap.bin";
+            printer.PushAttribute("gap", gapfile.c_str());
+            writer.Write(gapfile, sfxbank.entries[i].gap);
+        }
+        printer.CloseElement();
+        writer.Write(entryfile, sfxbank.entries[i].data);
+    }
+    writer.Flush();
+
+    printer.CloseElement();
+}
+
+void RomContext::DumpFXData(tinyxml2::XMLPrinter& printer, std::string basedir)
+{
+    FXDataSegment& fxdata = gamedata.fxdata;
+    std::string dir = basedir + "/" + fxdata.segname;
+    std::string headerfile = dir + "/header.bin";
+    MakeDirectory(dir);
+    printer.OpenElement("fxdata");
+    printer.PushAttribute("header", headerfile.c_str());
+
+    // Records are rebuilt from the binaries; records.txt is a word dump for diffing only
+    std::string text;
+    FileWriter writer(pool, writer_backend);
+    writer.Write(headerfile, fxdata.header);
+    for (size_t i = 0; i < fxdata.records.size(); i++) {
+        ByteView record = fxdata.records[i];
+        std::string recordfile = dir + "/" + std::to_string(i) + ".bin";
+        printer.OpenElement("record");
+        printer.PushAttribute("path", recordfile.c_str());
+        printer.CloseElement();
+        writer.Write(recordfile, record);
+
+        text += "record " + std::to_string(i) + "\n";
+        for (size_t j = 0; j < record.size(); j += 4) {
+            char word[16];
+            snprintf(word, sizeof(word), "%08X", ((uint32_t)record[j] << 24) | (record[j + 1] << 16) | (record[j + 2] << 8) | record[j + 3]);
+            text += word;
+            text += ((j / 4) % 8 == 7 || j + 4 >= record.size()) ? "\n" : " ";
+        }
+    }
+    std::vector<uint8_t> text_data(text.begin(), text.end());
+    writer.Write(dir + "/records.txt", text_data);
+    writer.Flush();
+
+    printer.CloseElement();
+}
+
+void RomContext::DumpGameData(std::string output)
+{
+    // The listing is written element by element as each segment is dumped
+    MakeDirectory(output);
+    std::string out_xml = output + "/romdata.xml";
+    FILE* file = fopen(out_xml.c_str(), "wb");
+    if (!file) {
+        throw RomError("Failed to open " + out_xml + " for writing.");
+    }
+    try {
+        DumpSegments(file, output);
+    }
+    catch (...) {
+        fclose(file);
+        throw;
+    }
+    bool write_error = ferror(file) != 0;
+    if (fclose(file) != 0 || write_error) {
+        throw RomError("Failed to write " + out_xml + ".");
+    }
+}
+
+void RomContext::DumpSegments(FILE* file, std::string output)
+{
+    tinyxml2::XMLPrinter printer(file);
+    printer.OpenElement("romdata");
+
+    // File data (already parallelized internally)
+    DumpFileData(printer, output + "/filedata");
+
+    // Message data segments
+    for (size_t i = 0; i < gamedata.messdata_all.size(); i++) {
+        if (gamedata.messdata_all[i].new_format) {
+            DumpMessDataExt(printer, output, i);
+        }
+        else {
+            DumpMessData(printer, output, i);
+        }
+    }
+
+    // Other data segments (already parallelized internally)
+    DumpHvqData(printer, output + "/hvqdata");
+
+    if (game_id == "mp2") {
+        DumpBgAnimData(printer, output + "/bganimdata");
+    }
+
+    SharedDataPaths shared_musdata;
+    for (size_t i = 0; i < gamedata.musbanks.size(); i++) {
+        DumpMusBank(printer, output + "/musdata", i, shared_musdata);
+    }
+
+    for (size_t i = 0; i < gamedata.sfxbanks.size(); i++) {
+        DumpSfxBank(printer, output, i);
+    }
+
+    DumpFXData(printer, output);
+
+    printer.CloseElement();
+}
+
+// Encoded file data from the previous rebuild to the same output, found either
+// by the source file's path and stat data or by its content. Content hits are
+// decoded and compared, so a hash collision never reuses the wrong data.
+class RebuildCache {
+public:
+    struct Entry {
+        FileStamp stamp;
+        uint32_t comp_type;
+        uint32_t encode_level;
+        ByteView encoded;
+    };
+
+    // A missing, outdated or damaged cache file leaves the cache empty
+    void Load(const std::string& path);
+    // Returns the entry for path if its size and mtime are unchanged
+    const Entry* FindStat(const FileStamp& stamp, uint32_t comp_type, EncodeLevel level) const;
+    // Returns an entry that decodes to data, whose hash is in stamp
+    const Entry* FindContent(const FileStamp& stamp, ByteView data, uint32_t comp_type, EncodeLevel level) const;
+
+private:
+    std::vector<uint8_t> buffer; // The cache file, which entries point into
+    std::vector<Entry> entries;
+    std::map<std::string, size_t> by_path;
+    std::multimap<uint64_t, size_t> by_hash;
+};
+
+void RebuildCache::Load(const std::string& path)
+{
+    std::vector<uint8_t> data;
+    try {
+        ReadWholeFile(path, data);
+    }
+    catch (const RomError&) {
+        return;
+    }
+    size_t offset = 0;
+    bool valid = true;
+    auto read32 = [&]() {
+        valid = valid && data.size() - offset >= 4;
+        uint32_t value = ReadBuffer32(data.data(), data.size(), offset);
+        offset += 4;
+        return value;
+    };
+    auto read64 = [&]() {
+        uint64_t value = (uint64_t)read32() << 32;
+        return value | read32();
+    };
+    auto read_bytes = [&](size_t size, ByteView& out) {
+        valid = valid && offset <= data.size() && data.size() - offset >= size;
+        if (valid) {
+            out = ByteView(data.data() + offset, size);
+            offset += size;
+        }
+    };
+    if (read32() != REBUILD_CACHE_MAGIC || read32() != REBUILD_CACHE_VERSION) {
+        return;
+    }
+    uint32_t count = read32();
+    std::vector<Entry> loaded;
+    for (uint32_t i = 0; valid && i < count; i++) {
+        Entry entry;
+        ByteView path_data;
+        read_bytes(read32(), path_data);
+        entry.stamp.path.assign(path_data.begin(), path_data.end());
+        entry.stamp.size = read64();
+        entry.stamp.mtime = (int64_t)read64();
+        entry.stamp.hash = read64();
+        entry.comp_type = read32();
+        entry.encode_level = read32();
+        read_bytes(read32(), entry.encoded);
+        loaded.push_back(std::move(entry));
+    }
+    if (!valid) {
+        return;
+    }
+    // Moving the file keeps its storage, so the entries stay valid
+    buffer = std::move(data);
+    entries = std::move(loaded);
+    for (size_t i = 0; i < entries.size(); i++) {
+        by_path[entries[i].stamp.path] = i;
+        by_hash.insert({ entries[i].stamp.hash, i });
+    }
+}
+
+const RebuildCache::Entry* RebuildCache::FindStat(const FileStamp& stamp, uint32_t comp_type, EncodeLevel level) const
+{
+    auto it = by_path.find(stamp.path);
+    if (it == by_path.end()) {
+        return nullptr;
+    }
+    const Entry& entry = entries[it->second];
+    if (entry.stamp.size != stamp.size || entry.stamp.mtime != stamp.mtime
+        || entry.comp_type != comp_type || entry.encode_level != (uint32_t)level) {
+        return nullptr;
+    }
+    return &entry;
+}
+
+// True if encoded is an entry that decodes to exactly data
+static bool DecodesTo(ByteView encoded, ByteView data)
+{
+    try {
+        StreamDecoder decoder(encoded.data(), encoded.size(), 0);
+        if (decoder.GetRawSize() != data.size()) {
+            return false;
+        }
+        uint8_t buf[4096];
+        size_t pos = 0;
+        while (!decoder.Done()) {
+            size_t size = decoder.DecodeSome(buf, sizeof(buf));
+            if (memcmp(buf, data.data() + pos, size) != 0) {
+                return false;
+            }
+            pos += size;
+        }
+        return decoder.GetCompSize() <= encoded.size();
+    }
+    catch (const RomError&) {
+        return false;
+    }
+}
+
+const RebuildCache::Entry* RebuildCache::FindContent(const FileStamp& stamp, ByteView data, uint32_t comp_type, EncodeLevel level) const
+{
+    auto range = by_hash.equal_range(stamp.hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        const Entry& entry = entries[it->second];
+        if (entry.stamp.size == stamp.size && entry.comp_type == comp_type && entry.encode_level == (uint32_t)level
+            && DecodesTo(entry.encoded, data)) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+void RomContext::ParseFileData(tinyxml2::XMLElement* element, const RebuildCache* cache)
+{
+    if (!element) {
+        throw RomError("Missing file data element.");
+    }
+    tinyxml2::XMLElement* child_elem = element->FirstChildElement("datadir");
+    while (child_elem) {
+        std::vector<FileData> files;
+        tinyxml2::XMLElement* file_elem = child_elem->FirstChildElement("file");
+        while (file_elem) {
+            FileData file;
+            unsigned int comp_type = 0;
+            const char* path = nullptr;
+            file.dir = gamedata.filedata.files.size();
+            file.file = files.size();
+            XMLCheck(file_elem->QueryAttribute("comptype", &comp_type));
+            XMLCheck(file_elem->QueryAttribute("path", &path));
+            file.comp_type = comp_type;
+            file.stamp.path = path;
+
+            // Files whose stat data matches the previous rebuild are not read
+            const RebuildCache::Entry* entry = nullptr;
+            if (cache && StatFile(path, file.stamp.size, file.stamp.mtime)) {
+                entry = cache->FindStat(file.stamp, file.comp_type, encode_level);
+                if (entry) {
+                    file.stamp.hash = entry->stamp.hash;
+                }
+            }
+            if (!entry) {
+                // Files touched without being changed are still found by content
+                file.data = ReadArenaFile(path);
+                file.stamp.size = file.data.size();
+                file.stamp.hash = HashBytes(file.data);
+                if (cache) {
+                    entry = cache->FindContent(file.stamp, file.data, file.comp_type, encode_level);
+                }
+            }
+            if (entry) {
+                file.encoded = entry->encoded;
+            }
+            files.push_back(std::move(file));
+            file_elem = file_elem->NextSiblingElement("file");
+        }
+        gamedata.filedata.files.push_back(std::move(files));
+        child_elem = child_elem->NextSiblingElement("datadir");
+    }
+}
+
+void RomContext::ParseMessData(tinyxml2::XMLElement* element)
+{
+    bool new_format = false;
+    int seg_index = 0;
+    XMLCheck(element->QueryAttribute("segindex", &seg_index));
+    XMLCheck(element->QueryAttribute("new_format", &new_format));
+    MessDataSegment& seg = gamedata.messdata_all[seg_index];
+    seg.new_format = new_format;
+    if (new_format) {
+        tinyxml2::XMLElement* dir_elem = element->FirstChildElement("messdir");
+        while (dir_elem) {
+            MessDataDir dir;
+            const char* path = nullptr;
+            dir.id = seg.mess_dir_all.size();
+            XMLCheck(dir_elem->QueryAttribute("path", &path));
+            dir.data = ReadArenaFile(path);
+            seg.mess_dir_all.push_back(dir);
+            dir_elem = dir_elem->NextSiblingElement("messdir");
+        }
+    }
+    else {
+        const char* path = nullptr;
+        XMLCheck(element->QueryAttribute("path", &path));
+        seg.full_data = ReadArenaFile(path);
+    }
+}
+
+void RomContext::ParseHvqData(tinyxml2::XMLElement* element)
+{
+    if (!element) {
+        throw RomError("Missing HVQ data element.");
+    }
+    tinyxml2::XMLElement* child_elem = element->FirstChildElement("hvqbg");
+    while (child_elem) {
+        const char* path = nullptr;
+        XMLCheck(child_elem->QueryAttribute("path", &path));
+        gamedata.hvqdata.hvq_data.push_back(ReadArenaFile(path));
+        child_elem = child_elem->NextSiblingElement("hvqbg");
+    }
+}
+
+void RomContext::ParseBgAnimData(tinyxml2::XMLElement* element)
+{
+    if (!element) {
+        if (game_id == "mp2") {
+            throw RomError("Missing Background Animation data element.");
+        }
+        return;
+    }
+    tinyxml2::XMLElement* child_elem = element->FirstChildElement("bganim");
+    while (child_elem) {
+        const char* path = nullptr;
+        XMLCheck(child_elem->QueryAttribute("path", &path));
+        gamedata.bganimdata.bganim_data.push_back(ReadArenaFile(path));
+        child_elem = child_elem->NextSiblingElement("bganim");
+    }
+}
+
+void RomContext::ParseMusBank(tinyxml2::XMLElement* element)
+{
+    bool new_format = false;
+    int seg_index = 0;
+    XMLCheck(element->QueryAttribute("segindex", &seg_index));
+    XMLCheck(element->QueryAttribute("new_format", &new_format));
+    tinyxml2::XMLElement* soundbankele = element->FirstChildElement("soundbank");
+    tinyxml2::XMLElement* wavetableele = element->FirstChildElement("wavetable");
+    tinyxml2::XMLElement* seqbankele = element->FirstChildElement("seqbank");
+    MusBankSegment& seg = gamedata.musbanks[seg_index];
+    seg.new_format = new_format;
+
+    // TODO change parsing
+    const char* soundbankpath = nullptr;
+    XMLCheck(soundbankele->QueryAttribute("path", &soundbankpath));
+    seg.libaudioseg.soundbankseg.data = ReadArenaFile(soundbankpath);
+
+    const char* wavetablepath = nullptr;
+    XMLCheck(wavetableele->QueryAttribute("path", &wavetablepath));
+    seg.libaudioseg.wavetableseg.data = ReadArenaFile(wavetablepath);
+
+    uint32_t count = seqbankele->ChildElementCount();
+    seg.libaudioseg.seqsegs.resize(count);
+
+    uint32_t i = 0;
+    tinyxml2::XMLElement* seqele = seqbankele->FirstChildElement("seq");
+    std::map<std::string, uint32_t> seqmap;
+    std::multimap<uint64_t, uint32_t> seqhashes;
+    while (seqele) {
+        const char* seqpath = nullptr;
+        int bank = 0;
+        SequenceSegment& seqseg = seg.libaudioseg.seqsegs[i];
+        XMLCheck(seqele->QueryAttribute("path", &seqpath));
+        XMLCheck(seqele->QueryIntAttribute("bank", &bank));
+        if (seg.new_format) {
+            int unk0 = 0, unk1 = 0;
+            XMLCheck(seqele->QueryIntAttribute("unk0", &unk0));
+            XMLCheck(seqele->QueryIntAttribute("unk1", &unk1));
+            seqseg.unk0 = unk0;
+            seqseg.unk1 = unk1;
+        }
+        seqseg.bank = bank;
+        if (seqmap.find(seqpath) == seqmap.end()) {
+            seqseg.data = ReadArenaFile(seqpath);
+            seqmap[seqpath] = i; // current index
+
+            // Sequences with the same content share one copy in the bank
+            uint64_t hash = HashBytes(seqseg.data);
+            auto range = seqhashes.equal_range(hash);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (seg.libaudioseg.seqsegs[it->second].data == seqseg.data) {
+                    seqseg.id = it->second;
+                    seqmap[seqpath] = it->second;
+                    seqseg.data = ByteView();
+                    break;
+                }
+            }
+            if (seqseg.id == -1) {
+                seqhashes.insert({ hash, i });
+            }
+        }
+        else {
+            seqseg.id = seqmap[seqpath]; // id with copy data
+        }
+        seqele = seqele->NextSiblingElement("seq");
+        i++;
+    }
+
+    if (seg.new_format) {
+        const char* unkdatapath = nullptr;
+        XMLCheck(element->QueryAttribute("unkdata_path", &unkdatapath));
+        ReadWholeFile(unkdatapath, seg.unkdata);
+        if (seg.unkdata.size() != 0x40 - 0x8) {
+            throw RomError("Unknown data for music bank " + std::to_string(seg_index) + " must be " + std::to_string(0x40 - 0x8) + " bytes.");
+        }
+    }
+}
+
+void RomContext::ParseSfxBank(tinyxml2::XMLElement* element)
+{
+    bool new_format = false;
+    int seg_index = 0;
+    XMLCheck(element->QueryAttribute("segindex", &seg_index));
+    XMLCheck(element->QueryAttribute("new_format", &new_format));
+    SfxBankSegment& seg = gamedata.sfxbanks[seg_index];
+    seg.new_format = new_format;
+    const char* path = nullptr;
+    if (element->QueryAttribute("path", &path) == tinyxml2::XML_SUCCESS) {
+        // Older extractions kept the whole bank in one file
+        ByteView data = ReadArenaFile(path);
+        ParseSfxBankData(seg, data.data(), data.size());
+        return;
+    }
+    XMLCheck(element->QueryAttribute("header", &path));
+    seg.header = ReadArenaFile(path);
+    seg.entries.clear();
+    for (tinyxml2::XMLElement* entryele = element->FirstChildElement("entry"); entryele; entryele = entryele->NextSiblingElement("entry")) {
+        SfxBankEntry entry;
+        XMLCheck(entryele->QueryAttribute("path", &path));
+        entryele->QueryAttribute("offset", &entry.offset);
+        entry.data = ReadArenaFile(path);
+        if (entryele->QueryAttribute("gap", &path) == tinyxml2::XML_SUCCESS) {
+            entry.gap = ReadArenaFile(path);
+        }
+        seg.entries.push_back(std::move(entry));
+    }
+    if (seg.entries.size() != GetSfxBankNumRecords(seg.new_format)) {
+        throw RomError("Sound effect bank " + seg.segname + " needs " + std::to_string(GetSfxBankNumRecords(seg.new_format)) + " entries.");
+    }
+}
+
+void RomContext::ParseFxData(tinyxml2::XMLElement* element)
+{
+    if (!element) {
+        throw RomError("Missing FX Data element.");
+    }
+    const char* path = nullptr;
+    if (element->QueryAttribute("path", &path) == tinyxml2::XML_SUCCESS) {
+        // Older extractions kept the whole block in one file
+        ByteView data = ReadArenaFile(path);
+        ParseFXData(data.data(), data.size());
+        return;
+    }
+    XMLCheck(element->QueryAttribute("header", &path));
+    gamedata.fxdata.header = ReadArenaFile(path);
+    if (gamedata.fxdata.header.size() != FXDATA_HEADER_SIZE) {
+        throw RomError("FX data header must be " + std::to_string(FXDATA_HEADER_SIZE) + " bytes.");
+    }
+    gamedata.fxdata.records.clear();
+    for (tinyxml2::XMLElement* recordele = element->FirstChildElement("record"); recordele; recordele = recordele->NextSiblingElement("record")) {
+        XMLCheck(recordele->QueryAttribute("path", &path));
+        ByteView record = ReadArenaFile(path);
+        if (record.size() != FXDATA_RECORD_SIZE) {
+            throw RomError(std::string("FX data record ") + path + " must be " + std::to_string(FXDATA_RECORD_SIZE) + " bytes.");
+        }
+        gamedata.fxdata.records.push_back(record);
+    }
+}
+
+// Multithreaded ROM data parsing
+void RomContext::ParseRomData(std::string src_file, const RebuildCache* cache)
+{
+    tinyxml2::XMLDocument document;
+    XMLCheck(document.LoadFile(src_file.c_str()));
+    tinyxml2::XMLElement* root = document.FirstChildElement("romdata");
+    if (!root) {
+        throw RomError("Invalid ROM Data file.");
+    }
+
+    // Parse file data in parallel (already parallelized in ParseFileData)
+    ParseFileData(root->FirstChildElement("filedata"), cache);
+
+    // Parse message data segments in parallel
+    TaskGroup group(pool);
+    tinyxml2::XMLElement* element = root->FirstChildElement("messdata");
+    while (element) {
+        group.Run([this, element]() {
+            ParseMessData(element);
+            });
+        element = element->NextSiblingElement("messdata");
+    }
+
+    // Parse other segments in parallel
+    group.Run([this, root]() {
+        ParseHvqData(root->FirstChildElement("hvqdata"));
+        });
+
+    if (game_id == "mp2") {
+        group.Run([this, root]() {
+            ParseBgAnimData(root->FirstChildElement("bganimdata"));
+            });
+    }
+
+    element = root->FirstChildElement("musbank");
+    while (element) {
+        group.Run([this, element]() {
+            ParseMusBank(element);
+            });
+        element = element->NextSiblingElement("musbank");
+    }
+
+    element = root->FirstChildElement("sfxbank");
+    while (element) {
+        group.Run([this, element]() {
+            ParseSfxBank(element);
+            });
+        element = element->NextSiblingElement("sfxbank");
+    }
+
+    group.Run([this, root]() {
+        ParseFxData(root->FirstChildElement("fxdata"));
+        });
+
+    // Wait for all parsing tasks to complete
+    group.Wait();
+}
+
+
+void WriteU8(FILE* file, uint8_t value)
+{
+    fwrite(&value, 1, 1, file);
+}
+
+void WriteU16(FILE* file, uint16_t value)
+{
+    uint8_t temp[2];
+    temp[0] = value >> 8;
+    temp[1] = value & 0xFF;
+    fwrite(temp, 2, 1, file);
+}
+
+void WriteU16At(FILE* file, uint16_t value, size_t offset)
+{
+    size_t prev_ofs = ftell(file);
+    uint8_t temp[2];
+    temp[0] = value >> 8;
+    temp[1] = value & 0xFF;
+    fseek(file, offset, SEEK_SET);
+    fwrite(temp, 2, 1, file);
+    fseek(file, prev_ofs, SEEK_SET);
+}
+
+void WriteU32(FILE* file, uint32_t value)
+{
+    uint8_t temp[4];
+    temp[0] = value >> 24;
+    temp[1] = (value >> 16) & 0xFF;
+    temp[2] = (value >> 8) & 0xFF;
+    temp[3] = value & 0xFF;
+    fwrite(temp, 4, 1, file);
+}
+
+void WriteU32At(FILE* file, uint32_t value, size_t offset)
+{
+    size_t prev_ofs = ftell(file);
+    uint8_t temp[4];
+    temp[0] = value >> 24;
+    temp[1] = (value >> 16) & 0xFF;
+    temp[2] = (value >> 8) & 0xFF;
+    temp[3] = value & 0xFF;
+    fseek(file, offset, SEEK_SET);
+    fwrite(temp, 4, 1, file);
+    fseek(file, prev_ofs, SEEK_SET);
+}
+
+void WriteRawBuffer(FILE* file, ByteView data)
+{
+    if (!data.empty()) {
+        fwrite(data.data(), 1, data.size(), file);
+    }
+}
+
+void WriteAlign(FILE* file, size_t align)
+{
+    while ((ftell(file) % align) != 0) {
+        WriteU8(file, 0);
+    }
+}
+
+void WriteAlignFF(FILE* file, size_t align)
+{
+    while ((ftell(file) % align) != 0) {
+        WriteU8(file, 0xFF);
+    }
+}
+
+#define N 1024   /* size of ring buffer */   
+#define F 66   /* upper limit for match_length */   
+#define THRESHOLD 2 /* encode string into position and length  if match_length is greater than this */
+#define NIL  N /* index for root of binary search trees */   
+
+// Codec kernels are built once per instruction set and the one in use is
+// picked at startup from cpuid. MSVC needs no flags for intrinsics; GCC and
+// Clang get them per function.
+#if defined(CPU_X86) && !defined(_MSC_VER)
+#define CPU_TARGET(ISA) __attribute__((target(ISA)))
+#else
+#define CPU_TARGET(ISA)
+#endif
+
+typedef size_t (*MatchLengthFunc)(const uint8_t* a, const uint8_t* b, size_t limit);
+typedef uint32_t (*LongestMatchFunc)(const uint8_t* src, uint32_t start, uint32_t pos, uint32_t limit, uint32_t best, uint32_t* match_pos);
+
+// The kernels one encode runs with, picked once and passed down so every
+// encode keeps the level it started with
+struct CodecKernels {
+    MatchLengthFunc match_length;
+    LongestMatchFunc longest_match;
+};
+
+// Number of leading bytes a and b have in common, at most limit. The buffers
+// may overlap, as long as limit bytes can be read from both.
+static size_t MatchLengthScalar(const uint8_t* a, const uint8_t* b, size_t limit)
+{
+    size_t len = 0;
+    while (len < limit && a[len] == b[len]) {
+        len++;
+    }
+    return len;
+}
+
+// Scans every start in [start, pos) for the earliest longest match with the
+// bytes at pos, reading at most limit bytes from pos. Only matches longer than
+// best count; returns the new best and leaves match_pos alone if none is.
+static uint32_t LongestMatchScalar(const uint8_t* src, uint32_t start, uint32_t pos, uint32_t limit, uint32_t best, uint32_t* match_pos)
+{
+    for (uint32_t i = start; i < pos && best < limit; i++) {
+        uint32_t len = MatchLengthScalar(&src[i], &src[pos], limit);
+        if (len > best) {
+            best = len;
+            *match_pos = i;
+        }
+    }
+    return best;
+}
+
+#if defined(CPU_X86)
+static inline uint32_t CountTrailingZeros64(uint64_t value)
+{
+#if defined(_WIN64)
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return index;
+#elif defined(_WIN32)
+    unsigned long index;
+    if (_BitScanForward(&index, (uint32_t)value)) {
+        return index;
+    }
+    _BitScanForward(&index, (uint32_t)(value >> 32));
+    return index + 32;
+#else
+    return __builtin_ctzll(value);
+#endif
+}
+
+CPU_TARGET("sse4.2") static size_t MatchLengthSse42(const uint8_t* a, const uint8_t* b, size_t limit)
+{
+    size_t len = 0;
+    while (len + 16 <= limit) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + len));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + len));
+        int index = _mm_cmpestri(x, 16, y, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_EACH | _SIDD_NEGATIVE_POLARITY);
+        if (index < 16) {
+            return len + index;
+        }
+        len += 16;
+    }
+    return len + MatchLengthScalar(a + len, b + len, limit - len);
+}
+
+CPU_TARGET("avx2") static size_t MatchLengthAvx2(const uint8_t* a, const uint8_t* b, size_t limit)
+{
+    size_t len = 0;
+    while (len + 32 <= limit) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + len));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + len));
+        uint32_t diff = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (diff != 0) {
+            return len + CountTrailingZeros64(diff);
+        }
+        len += 32;
+    }
+    return len + MatchLengthScalar(a + len, b + len, limit - len);
+}
+
+CPU_TARGET("avx512f,avx512bw") static size_t MatchLengthAvx512(const uint8_t* a, const uint8_t* b, size_t limit)
+{
+    size_t len = 0;
+    while (len + 64 <= limit) {
+        __m512i x = _mm512_loadu_si512((const void*)(a + len));
+        __m512i y = _mm512_loadu_si512((const void*)(b + len));
+        uint64_t diff = _mm512_cmpneq_epi8_mask(x, y);
+        if (diff != 0) {
+            return len + CountTrailingZeros64(diff);
+        }
+        len += 64;
+    }
+    return len + MatchLengthScalar(a + len, b + len, limit - len);
+}
+
+// The vector scans test a block of starts at once for the first byte and the
+// byte at the current best length; only starts passing both can beat it. A new
+// best changes the second test, so the scan picks up after that start.
+CPU_TARGET("sse4.2") static uint32_t LongestMatchSse42(const uint8_t* src, uint32_t start, uint32_t pos, uint32_t limit, uint32_t best, uint32_t* match_pos)
+{
+    uint32_t i = start;
+    while (i < pos && best < limit) {
+        if (i + 16 > pos || i + best + 16 > pos + limit) {
+            uint32_t len = MatchLengthSse42(&src[i], &src[pos], limit);
+            if (len > best) {
+                best = len;
+                *match_pos = i;
+            }
+            i++;
+            continue;
+        }
+        __m128i first = _mm_set1_epi8(src[pos]);
+        __m128i last = _mm_set1_epi8(src[pos + best]);
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&src[i]), first))
+            & _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&src[i + best]), last));
+        uint32_t next = i + 16;
+        while (mask != 0) {
+            uint32_t cand = i + CountTrailingZeros64(mask);
+            uint32_t len = MatchLengthSse42(&src[cand], &src[pos], limit);
+            if (len > best) {
+                best = len;
+                *match_pos = cand;
+                next = cand + 1;
+                break;
+            }
+            mask &= mask - 1;
+        }
+        i = next;
+    }
+    return best;
+}
+
+CPU_TARGET("avx2") static uint32_t LongestMatchAvx2(const uint8_t* src, uint32_t start, uint32_t pos, uint32_t limit, uint32_t best, uint32_t* match_pos)
+{
+    uint32_t i = start;
+    while (i < pos && best < limit) {
+        if (i + 32 > pos || i + best + 32 > pos + limit) {
+            uint32_t len = MatchLengthAvx2(&src[i], &src[pos], limit);
+            if (len > best) {
+                best = len;
+                *match_pos = i;
+            }
+            i++;
+            continue;
+        }
+        __m256i first = _mm256_set1_epi8(src[pos]);
+        __m256i last = _mm256_set1_epi8(src[pos + best]);
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)&src[i]), first))
+            & (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)&src[i + best]), last));
+        uint32_t next = i + 32;
+        while (mask != 0) {
+            uint32_t cand = i + CountTrailingZeros64(mask);
+            uint32_t len = MatchLengthAvx2(&src[cand], &src[pos], limit);
+            if (len > best) {
+                best = len;
+                *match_pos = cand;
+                next = cand + 1;
+                break;
+            }
+            mask &= mask - 1;
+        }
+        i = next;
+    }
+    return best;
+}
+
+CPU_TARGET("avx512f,avx512bw") static uint32_t LongestMatchAvx512(const uint8_t* src, uint32_t start, uint32_t pos, uint32_t limit, uint32_t best, uint32_t* match_pos)
+{
+    uint32_t i = start;
+    while (i < pos && best < limit) {
+        if (i + 64 > pos || i + best + 64 > pos + limit) {
+            uint32_t len = MatchLengthAvx512(&src[i], &src[pos], limit);
+            if (len > best) {
+                best = len;
+                *match_pos = i;
+            }
+            i++;
+            continue;
+        }
+        __m512i first = _mm512_set1_epi8(src[pos]);
+        __m512i last = _mm512_set1_epi8(src[pos + best]);
+        uint64_t mask = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void*)&src[i]), first)
+            & _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void*)&src[i + best]), last);
+        uint32_t next = i + 64;
+        while (mask != 0) {
+            uint32_t cand = i + CountTrailingZeros64(mask);
+            uint32_t len = MatchLengthAvx512(&src[cand], &src[pos], limit);
+            if (len > best) {
+                best = len;
+                *match_pos = cand;
+                next = cand + 1;
+                break;
+            }
+            mask &= mask - 1;
+        }
+        i = next;
+    }
+    return best;
+}
+
+static void CpuId(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+#if defined(_WIN32)
+    int info[4];
+    __cpuidex(info, leaf, subleaf);
+    for (int i = 0; i < 4; i++) {
+        regs[i] = info[i];
+    }
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Register state the OS saves on context switches
+CPU_TARGET("xsave") static uint64_t ReadXcr0()
+{
+#if defined(_WIN32)
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+#endif
+}
+#endif
+
+static CpuLevel DetectCpuLevel()
+{
+#if defined(CPU_X86)
+    uint32_t regs[4];
+    CpuId(0, 0, regs);
+    uint32_t max_leaf = regs[0];
+    CpuId(1, 0, regs);
+    if (!(regs[2] & (1 << 20))) {
+        return CpuLevel::Scalar;
+    }
+    bool osxsave = (regs[2] & (1 << 27)) != 0;
+    bool avx = (regs[2] & (1 << 28)) != 0;
+    uint64_t xcr0 = osxsave ? ReadXcr0() : 0;
+    if (max_leaf < 7 || !avx || (xcr0 & 0x6) != 0x6) {
+        return CpuLevel::Sse42;
+    }
+    CpuId(7, 0, regs);
+    if (!(regs[1] & (1 << 5))) {
+        return CpuLevel::Sse42;
+    }
+    // AVX-512 F and BW, with opmask and ZMM state enabled
+    if ((regs[1] & (1 << 16)) && (regs[1] & (1 << 30)) && (xcr0 & 0xE0) == 0xE0) {
+        return CpuLevel::Avx512;
+    }
+    return CpuLevel::Avx2;
+#else
+    return CpuLevel::Scalar;
+#endif
+}
+
+static MatchLengthFunc GetMatchLengthFunc(CpuLevel level)
+{
+    switch (level) {
+#if defined(CPU_X86)
+    case CpuLevel::Sse42:
+        return MatchLengthSse42;
+
+    case CpuLevel::Avx2:
+        return MatchLengthAvx2;
+
+    case CpuLevel::Avx512:
+        return MatchLengthAvx512;
+#endif
+
+    default:
+        return MatchLengthScalar;
+    }
+}
+
+static LongestMatchFunc GetLongestMatchFunc(CpuLevel level)
+{
+    switch (level) {
+#if defined(CPU_X86)
+    case CpuLevel::Sse42:
+        return LongestMatchSse42;
+
+    case CpuLevel::Avx2:
+        return LongestMatchAvx2;
+
+    case CpuLevel::Avx512:
+        return LongestMatchAvx512;
+#endif
+
+    default:
+        return LongestMatchScalar;
+    }
+}
+
+static const CpuLevel best_cpu_level = DetectCpuLevel();
+static std::atomic<CpuLevel> default_cpu_level(best_cpu_level);
+
+// Levels the CPU lacks fall back to the best supported one
+static CodecKernels GetCodecKernels(CpuLevel level)
+{
+    level = std::min(level, best_cpu_level);
+    return { GetMatchLengthFunc(level), GetLongestMatchFunc(level) };
+}
+
+CpuLevel GetBestCpuLevel()
+{
+    return best_cpu_level;
+}
+
+CpuLevel GetCpuLevel()
+{
+    return default_cpu_level;
+}
+
+bool SetCpuLevel(CpuLevel level)
+{
+    if (level > best_cpu_level) {
+        return false;
+    }
+    default_cpu_level = level;
+    return true;
+}
+
+const char* GetCpuLevelName(CpuLevel level)
+{
+    switch (level) {
+    case CpuLevel::Sse42:
+        return "sse4.2";
+
+    case CpuLevel::Avx2:
+        return "avx2";
+
+    case CpuLevel::Avx512:
+        return "avx512";
+
+    default:
+        return "scalar";
+    }
+}
+
+// Longest match at most window bytes back for every position in [begin, end),
+// following hash chains of 3-byte prefixes at most max_chain links deep
+static void FindMatches(const CodecKernels& kernels, ByteView src, uint32_t begin, uint32_t end, uint32_t window, uint32_t max_match,
+    uint32_t max_chain, uint32_t* lengths, uint32_t* positions)
+{
+    uint32_t len = src.size();
+    uint32_t base = begin > window ? begin - window : 0;
+    std::vector<int32_t> head(1 << MATCH_HASH_BITS, -1);
+    std::vector<int32_t> prev(end - base, -1);
+    for (uint32_t pos = base; pos < end; pos++) {
+        if (pos + 3 > len) {
+            if (pos >= begin) {
+                lengths[pos - begin] = 0;
+            }
+            continue;
+        }
+        uint32_t hash = ((src[pos] << 10) ^ (src[pos + 1] << 5) ^ src[pos + 2]) & ((1 << MATCH_HASH_BITS) - 1);
+        if (pos >= begin) {
+            uint32_t limit = std::min<uint32_t>(max_match, len - pos);
+            uint32_t best_len = 0;
+            uint32_t best_pos = 0;
+            uint32_t links = 0;
+            for (int32_t cand = head[hash]; cand >= 0 && pos - cand <= window && links < max_chain; cand = prev[cand - base], links++) {
+                if (src[cand + best_len] != src[pos + best_len]) {
+                    continue;
+                }
+                uint32_t match_len = kernels.match_length(&src[cand], &src[pos], limit);
+                if (match_len > best_len) {
+                    best_len = match_len;
+                    best_pos = cand;
+                    if (match_len == limit) {
+                        break;
+                    }
+                }
+            }
+            lengths[pos - begin] = best_len >= 3 ? best_len : 0;
+            positions[pos - begin] = best_pos;
+        }
+        prev[pos - base] = head[hash];
+        head[hash] = pos;
+    }
+}
+
+static void FindMatchesParallel(ThreadPool& pool, const CodecKernels& kernels, ByteView src, uint32_t window, uint32_t max_match,
+    uint32_t max_chain, std::vector<uint32_t>& lengths, std::vector<uint32_t>& positions)
+{
+    uint32_t len = src.size();
+    lengths.resize(len);
+    positions.resize(len);
+    TaskGroup group(pool);
+    for (uint32_t begin = 0; begin < len; begin += MATCH_CHUNK_SIZE) {
+        group.Run([&, begin]() {
+            uint32_t end = std::min<uint32_t>(begin + MATCH_CHUNK_SIZE, len);
+            FindMatches(kernels, src, begin, end, window, max_match, max_chain, &lengths[begin], &positions[begin]);
+            });
+    }
+    group.Wait();
+}
+
+// Takes the match at each position whenever there is one. Returns the
+// length of each step, 1 for a straight copy.
+static std::vector<uint32_t> ParseGreedy(const std::vector<uint32_t>& lengths)
+{
+    std::vector<uint32_t> steps;
+    for (size_t pos = 0; pos < lengths.size(); pos += steps.back()) {
+        steps.push_back(lengths[pos] >= 3 ? lengths[pos] : 1);
+    }
+    return steps;
+}
+
+// Cheapest path through the data where a straight copy costs literal_cost bits
+// and a match of n bytes costs match_cost(n), whatever its distance. Any length
+// up to the longest match at a position can be used from the same source.
+static std::vector<uint32_t> ParseOptimal(const std::vector<uint32_t>& lengths, uint32_t literal_cost, uint32_t (*match_cost)(uint32_t))
+{
+    uint32_t len = lengths.size();
+    std::vector<uint32_t> cost(len + 1, UINT32_MAX);
+    std::vector<uint16_t> step(len + 1, 0);
+    cost[0] = 0;
+    for (uint32_t pos = 0; pos < len; pos++) {
+        if (cost[pos] + literal_cost < cost[pos + 1]) {
+            cost[pos + 1] = cost[pos] + literal_cost;
+            step[pos + 1] = 1;
+        }
+        for (uint32_t match_len = 3; match_len <= lengths[pos]; match_len++) {
+            uint32_t total = cost[pos] + match_cost(match_len);
+            if (total < cost[pos + match_len]) {
+                cost[pos + match_len] = total;
+                step[pos + match_len] = match_len;
+            }
+        }
+    }
+    std::vector<uint32_t> steps;
+    for (uint32_t pos = len; pos > 0; pos -= step[pos]) {
+        steps.push_back(step[pos]);
+    }
+    std::reverse(steps.begin(), steps.end());
+    return steps;
+}
+
+/* Encoder state is kept per instance so several files can be compressed at once */
+struct LzssEncoder {
+    uint8_t text_buf[N + F - 1];    /* ring buffer of size N,
+            with extra F-1 bytes to facilitate string comparison */
+    int match_position, match_length,  /* of longest match.  These are
+                            set by the InsertNode() procedure. */
+        lson[N + 1], rson[N + 257], dad[N + 1];  /* left & right children &
+                parents -- These constitute binary search trees. */
+
+    MatchLengthFunc match_length_kernel;
+
+    void InitTree(void);
+    void InsertNode(int r);
+    void DeleteNode(int p);
+    void Encode(FILE* dst_file, ByteView src);
+};
+
+void LzssEncoder::InitTree(void)  /* initialize trees */
+{
+    int  i;
+
+    /* For i = 0 to N - 1, rson[i] and lson[i] will be the right and
+       left children of node i.  These nodes need not be initialized.
+       Also, dad[i] is the parent of node i.  These are initialized to
+       NIL (= N), which stands for 'not used.'
+       For i = 0 to 255, rson[N + i + 1] is the root of the tree
+       for strings that begin with character i.  These are initialized
+       to NIL.  Note there are 256 trees. */
+
+    for (i = N + 1; i <= N + 256; i++) rson[i] = NIL;
+    for (i = 0; i < N; i++) dad[i] = NIL;
+}
+
+void LzssEncoder::InsertNode(int r)
+/* Inserts string of length F, text_buf[r..r+F-1], into one of the
+   trees (text_buf[r]'th tree) and returns the longest-match position
+   and length via the global variables match_position and match_length.
+   If match_length = F, then removes the old node in favor of the new
+   one, because the old one will be deleted sooner.
+   Note r plays double role, as tree node and position in buffer. */
+{
+    int  i, p, cmp;
+    uint8_t* key;
+
+    cmp = 1;  key = &text_buf[r];  p = N + 1 + key[0];
+    rson[r] = lson[r] = NIL;  match_length = 0;
+    for (; ; ) {
+        if (cmp >= 0) {
+            if (rson[p] != NIL) p = rson[p];
+            else { rson[p] = r;  dad[r] = p;  return; }
+        }
+        else {
+            if (lson[p] != NIL) p = lson[p];
+            else { lson[p] = r;  dad[r] = p;  return; }
+        }
+        i = 1 + match_length_kernel(&key[1], &text_buf[p + 1], F - 1);
+        cmp = i < F ? key[i] - text_buf[p + i] : 0;
+        if (i > match_length) {
+            match_position = p;
+            if ((match_length = i) >= F)  break;
+        }
+    }
+    dad[r] = dad[p];  lson[r] = lson[p];  rson[r] = rson[p];
+    dad[lson[p]] = r;  dad[rson[p]] = r;
+    if (rson[dad[p]] == p) rson[dad[p]] = r;
+    else                   lson[dad[p]] = r;
+    dad[p] = NIL;  /* remove p */
+}
+
+void LzssEncoder::DeleteNode(int p)  /* deletes node p from tree */
+{
+    int  q;
+
+    if (dad[p] == NIL) return;  /* not in tree */
+    if (rson[p] == NIL) q = lson[p];
+    else if (lson[p] == NIL) q = rson[p];
+    else {
+        q = lson[p];
+        if (rson[q] != NIL) {
+            do { q = rson[q]; } while (rson[q] != NIL);
+            rson[dad[q]] = lson[q];  dad[lson[q]] = dad[q];
+            lson[q] = lson[p];  dad[lson[p]] = q;
+        }
+        rson[q] = rson[p];  dad[rson[p]] = q;
+    }
+    dad[q] = dad[p];
+    if (rson[dad[p]] == p) rson[dad[p]] = q;  else lson[dad[p]] = q;
+    dad[p] = NIL;
+}
+
+void LzssEncoder::Encode(FILE* dst_file, ByteView src)
+{
+    int  i, c, len, r, s, last_match_length, code_buf_ptr;
+    uint8_t code_buf[17], mask;
+    size_t src_pos = 0;
+
+    InitTree();  /* initialize trees */
+    code_buf[0] = 0;  /* code_buf[1..16] saves eight units of code, and
+            code_buf[0] works as eight flags, "1" representing that the unit
+            is an unencoded letter (1 byte), "0" a position-and-length pair
+            (2 bytes).  Thus, eight units require at most 16 bytes of code. */
+    code_buf_ptr = mask = 1;
+    s = 0;  r = N - F;
+    for (i = s; i < r; i++) text_buf[i] = '\0';  /* Clear the buffer with
+            any character that will appear often. */
+    for (len = 0; len < F && src_pos < src.size(); len++)
+        text_buf[r + len] = c = src[src_pos++];  /* Read F bytes into the last F bytes of
+                the buffer */
+    if (len == 0) return;  /* text of size zero */
+    for (i = 1; i <= F; i++) InsertNode(r - i);  /* Insert the F strings,
+            each of which begins with one or more 'space' characters.  Note
+            the order in which these strings are inserted.  This way,
+            degenerate trees will be less likely to occur. */
+    InsertNode(r);  /* Finally, insert the whole string just read.  The
+            global variables match_length and match_position are set. */
+    do {
+        if (match_length > len) match_length = len;  /* match_length
+                may be spuriously long near the end of text. */
+        if (match_length <= THRESHOLD) {
+            match_length = 1;  /* Not long enough match.  Send one byte. */
+            code_buf[0] |= mask;  /* 'send one byte' flag */
+            code_buf[code_buf_ptr++] = text_buf[r];  /* Send uncoded. */
+        }
+        else {
+            code_buf[code_buf_ptr++] = (uint8_t)match_position;
+            code_buf[code_buf_ptr++] = (uint8_t)
+                (((match_position >> 2) & 0xC0)
+                    | (match_length - (THRESHOLD + 1)));  /* Send position and
+                                  length pair. Note match_length > THRESHOLD. */
+        }
+        if ((mask <<= 1) == 0) {  /* Shift mask left one bit. */
+            for (i = 0; i < code_buf_ptr; i++)  /* Send at most 8 units of */
+                putc(code_buf[i], dst_file);     /* code together */
+            code_buf[0] = 0;  code_buf_ptr = mask = 1;
+        }
+        last_match_length = match_length;
+        for (i = 0; i < last_match_length &&
+            src_pos < src.size(); i++) {
+            DeleteNode(s);          /* Delete old strings and */
+            text_buf[s] = c = src[src_pos++];        /* read new bytes */
+            if (s < F - 1) text_buf[s + N] = c;  /* If the position is
+                    near the end of buffer, extend the buffer to make
+                    string comparison easier. */
+            s = (s + 1) & (N - 1);  r = (r + 1) & (N - 1);
+            /* Since this is a ring buffer, increment the position
+               modulo N. */
+            InsertNode(r);  /* Register the string in text_buf[r..r+F-1] */
+        }
+        while (i++ < last_match_length) {       /* After the end of text, */
+            DeleteNode(s);                                  /* no need to read, but */
+            s = (s + 1) & (N - 1);  r = (r + 1) & (N - 1);
+            if (--len) InsertNode(r);               /* buffer may not be empty. */
+        }
+    } while (len > 0);      /* until length of string to be processed is zero */
+    if (code_buf_ptr > 1) {         /* Send remaining code. */
+        for (i = 0; i < code_buf_ptr; i++) putc(code_buf[i], dst_file);
+    }
+}
+
+// Every LZ match is a flag bit plus a two byte token whatever its length
+static uint32_t LzMatchCost(uint32_t /*match_len*/)
+{
+    return 17;
+}
+
+// Writes the parse as flag bytes for every eight steps, a set bit marking a
+// straight copy. Matches name the window slot their source was written to.
+static void WriteLzSteps(FILE* dst_file, ByteView src, const std::vector<uint32_t>& steps, const std::vector<uint32_t>& positions)
+{
+    uint8_t code_buf[17];
+    uint32_t code_buf_ptr = 1;
+    uint32_t num_codes = 0;
+    uint32_t pos = 0;
+    code_buf[0] = 0;
+    for (uint32_t step : steps) {
+        if (step < 3) {
+            code_buf[0] |= 1 << num_codes;
+            code_buf[code_buf_ptr++] = src[pos];
+        }
+        else {
+            uint32_t slot = (LZ_WINDOW_OFS + positions[pos]) % LZ_WINDOW_SIZE;
+            code_buf[code_buf_ptr++] = slot & 0xFF;
+            code_buf[code_buf_ptr++] = ((slot >> 2) & 0xC0) | (step - 3);
+        }
+        pos += step;
+        if (++num_codes == 8) {
+            fwrite(code_buf, 1, code_buf_ptr, dst_file);
+            code_buf[0] = 0;
+            code_buf_ptr = 1;
+            num_codes = 0;
+        }
+    }
+    if (code_buf_ptr > 1) {
+        fwrite(code_buf, 1, code_buf_ptr, dst_file);
+    }
+}
+
+void EncodeLZSS(FILE* dst_file, ByteView src, ThreadPool& pool, EncodeLevel level, const CodecKernels& kernels)
+{
+    if (level == EncodeLevel::Default) {
+        std::unique_ptr<LzssEncoder> encoder(new LzssEncoder());
+        encoder->match_length_kernel = kernels.match_length;
+        encoder->Encode(dst_file, src);
+        return;
+    }
+    std::vector<uint32_t> lengths;
+    std::vector<uint32_t> positions;
+    if (level == EncodeLevel::Fast) {
+        FindMatchesParallel(pool, kernels, src, LZ_WINDOW_SIZE, LZ_MAX_MATCH, MATCH_FAST_CHAIN, lengths, positions);
+        WriteLzSteps(dst_file, src, ParseGreedy(lengths), positions);
+        return;
+    }
+    FindMatchesParallel(pool, kernels, src, LZ_WINDOW_SIZE, LZ_MAX_MATCH, UINT32_MAX, lengths, positions);
+
+    // The window starts out zeroed, so zeros in the first 1024 bytes can also
+    // come from slots that have not been written yet. Positions wrap below zero
+    // and still name the right slot, as 2^32 is a multiple of the window size.
+    uint32_t zero_run = 0;
+    for (uint32_t pos = std::min<uint32_t>(src.size(), LZ_WINDOW_SIZE); pos-- > 0;) {
+        zero_run = src[pos] == 0 ? zero_run + 1 : 0;
+        uint32_t zero_len = std::min<uint32_t>(std::min<uint32_t>(zero_run, LZ_WINDOW_SIZE - pos), LZ_MAX_MATCH);
+        if (zero_len >= 3 && zero_len > lengths[pos]) {
+            lengths[pos] = zero_len;
+            positions[pos] = pos - LZ_WINDOW_SIZE;
+        }
+    }
+    WriteLzSteps(dst_file, src, ParseOptimal(lengths, 9, LzMatchCost), positions);
+}
+
+void EncodeNone(FILE* file, ByteView data)
+{
+    WriteRawBuffer(file, data);
+}
+
+
+// simple and straight encoding scheme for Yaz0
+uint32_t simpleEnc(const CodecKernels& kernels, const uint8_t* src, uint32_t size, uint32_t pos, uint32_t* pMatchPos)
+{
+    uint32_t startPos = pos - 0x1000;
+    uint32_t numBytes;
+    uint32_t matchPos = 0;
+
+    if (pos < 0x1000)
+        startPos = 0;
+    numBytes = kernels.longest_match(src, startPos, pos, size - pos, 1, &matchPos);
+    *pMatchPos = matchPos;
+    if (numBytes == 2)
+        numBytes = 1;
+    return numBytes;
+}
+
+// look-ahead state carried between nintendoEnc calls for one file
+struct NintendoEncState
+{
+    uint32_t numBytes1 = 0;
+    uint32_t matchPos = 0;
+    int prevFlag = 0;
+};
+
+// a lookahead encoding scheme for ngc Yaz0
+uint32_t nintendoEnc(NintendoEncState& state, const CodecKernels& kernels, const uint8_t* src, uint32_t size, uint32_t pos, uint32_t* pMatchPos)
+{
+    uint32_t numBytes = 1;
+
+    // if prevFlag is set, it means that the previous position was determined by look-ahead try.
+    // so just use it. this is not the best optimization, but nintendo's choice for speed.
+    if (state.prevFlag == 1) {
+        *pMatchPos = state.matchPos;
+        state.prevFlag = 0;
+        return state.numBytes1;
+    }
+    state.prevFlag = 0;
+    numBytes = simpleEnc(kernels, src, size, pos, &state.matchPos);
+    *pMatchPos = state.matchPos;
+
+    // if this position is RLE encoded, then compare to copying 1 byte and next position(pos+1) encoding
+    if (numBytes >= 3) {
+        state.numBytes1 = simpleEnc(kernels, src, size, pos + 1, &state.matchPos);
+        // if the next position encoding is +2 longer than current position, choose it.
+        // this does not guarantee the best optimization, but fairly good optimization with speed.
+        if (state.numBytes1 >= numBytes + 2) {
+            numBytes = 1;
+            state.prevFlag = 1;
+        }
+    }
+    return numBytes;
+}
+
+// one step of the parse: a straight copy when numBytes < 3, otherwise a match
+struct SlideToken
+{
+    uint32_t pos;
+    uint32_t numBytes;
+    uint32_t matchPos;
+    bool lookahead; // prevFlag was set going into this step
+};
+
+// parses from pos until the last step reaches end
+static uint32_t ParseSlide(NintendoEncState& state, const CodecKernels& kernels, ByteView src, uint32_t pos, uint32_t end, std::vector<SlideToken>& tokens)
+{
+    while (pos < end) {
+        SlideToken token;
+        token.pos = pos;
+        token.lookahead = state.prevFlag == 1;
+        token.numBytes = nintendoEnc(state, kernels, src.data(), src.size(), pos, &token.matchPos);
+        pos += token.numBytes < 3 ? 1 : std::min<uint32_t>(token.numBytes, 0xff + 0x12);
+        tokens.push_back(token);
+    }
+    return pos;
+}
+
+// Matches only look back 0x1000 bytes, so chunks of a large file are parsed in
+// parallel from guessed starting points. Each guess is kept from the first step
+// where it lines up with the real parse with no look-ahead pending, after which
+// both parses are identical.
+static void ParseSlideParallel(ThreadPool& pool, const CodecKernels& kernels, ByteView src, std::vector<SlideToken>& tokens)
+{
+    uint32_t len = src.size();
+    size_t num_chunks = (len + SLIDE_CHUNK_SIZE - 1) / SLIDE_CHUNK_SIZE;
+    std::vector<std::vector<SlideToken>> chunk_tokens(num_chunks);
+    std::vector<NintendoEncState> chunk_states(num_chunks);
+    std::vector<uint32_t> chunk_ends(num_chunks);
+    TaskGroup group(pool);
+    for (size_t i = 0; i < num_chunks; i++) {
+        group.Run([&, i]() {
+            uint32_t end = std::min<uint32_t>((i + 1) * SLIDE_CHUNK_SIZE, len);
+            chunk_ends[i] = ParseSlide(chunk_states[i], kernels, src, i * SLIDE_CHUNK_SIZE, end, chunk_tokens[i]);
+            });
+    }
+    group.Wait();
+
+    tokens = std::move(chunk_tokens[0]);
+    NintendoEncState state = chunk_states[0];
+    uint32_t pos = chunk_ends[0];
+    for (size_t i = 1; i < num_chunks; i++) {
+        const std::vector<SlideToken>& guess = chunk_tokens[i];
+        uint32_t end = std::min<uint32_t>((i + 1) * SLIDE_CHUNK_SIZE, len);
+        size_t index = 0;
+        while (pos < end) {
+            while (index < guess.size() && guess[index].pos < pos) {
+                index++;
+            }
+            if (index < guess.size() && guess[index].pos == pos && !guess[index].lookahead && state.prevFlag == 0) {
+                tokens.insert(tokens.end(), guess.begin() + index, guess.end());
+                state = chunk_states[i];
+                pos = chunk_ends[i];
+                break;
+            }
+            pos = ParseSlide(state, kernels, src, pos, pos + 1, tokens);
+        }
+    }
+}
+
+static uint32_t SlideMatchCost(uint32_t match_len)
+{
+    return match_len < 0x12 ? 17 : 25;
+}
+
+static void GetSlideTokens(const std::vector<uint32_t>& steps, const std::vector<uint32_t>& positions, std::vector<SlideToken>& tokens)
+{
+    uint32_t pos = 0;
+    tokens.resize(steps.size());
+    for (size_t i = 0; i < steps.size(); i++) {
+        tokens[i].pos = pos;
+        tokens[i].numBytes = steps[i];
+        tokens[i].matchPos = positions[pos];
+        tokens[i].lookahead = false;
+        pos += steps[i];
+    }
+}
+
+void EncodeSlide(FILE* dst_file, ByteView src, ThreadPool& pool, EncodeLevel level, const CodecKernels& kernels)
+{
+    uint8_t dst[96];    // 32 codes * 3 bytes maximum
+    uint32_t dstPos = 0;
+    size_t len = src.size();
+    uint32_t validBitCount = 0; //number of valid bits left in "code" byte
+    uint32_t currCodeByte = 0;
+    std::vector<SlideToken> tokens;
+    if (level != EncodeLevel::Default) {
+        // Greedy over a shallow search when fast, shortest path over the whole
+        // window otherwise; a straight copy costs 9 bits with its flag
+        std::vector<uint32_t> lengths;
+        std::vector<uint32_t> positions;
+        bool fast = level == EncodeLevel::Fast;
+        FindMatchesParallel(pool, kernels, src, SLIDE_WINDOW_SIZE, SLIDE_MAX_MATCH, fast ? MATCH_FAST_CHAIN : UINT32_MAX, lengths, positions);
+        GetSlideTokens(fast ? ParseGreedy(lengths) : ParseOptimal(lengths, 9, SlideMatchCost), positions, tokens);
+    }
+    else if (len >= SLIDE_CHUNK_SIZE * 2) {
+        ParseSlideParallel(pool, kernels, src, tokens);
+    }
+    else {
+        NintendoEncState state;
+        ParseSlide(state, kernels, src, 0, len, tokens);
+    }
+    WriteU32(dst_file, len);
+    for (const SlideToken& token : tokens)
+    {
+        uint32_t numBytes = token.numBytes;
+        if (numBytes < 3)
+        {
+            //straight copy
+            dst[dstPos++] = src[token.pos];
+            //set flag for straight copy
+            currCodeByte |= (0x80000000 >> validBitCount);
+        }
+        else
+        {
+            //RLE part
+            uint32_t dist = token.pos - token.matchPos - 1;
+            uint8_t byte1, byte2, byte3;
+
+            if (numBytes >= 0x12)  // 3 byte encoding
+            {
+                byte1 = 0 | (dist >> 8);
+                byte2 = dist & 0xff;
+                dst[dstPos++] = byte1;
+                dst[dstPos++] = byte2;
+                // maximum runlength for 3 byte encoding
+                if (numBytes > 0xff + 0x12)
+                    numBytes = 0xff + 0x12;
+                byte3 = numBytes - 0x12;
+                dst[dstPos++] = byte3;
+            }
+            else  // 2 byte encoding
+            {
+                byte1 = ((numBytes - 2) << 4) | (dist >> 8);
+                byte2 = dist & 0xff;
+                dst[dstPos++] = byte1;
+                dst[dstPos++] = byte2;
+            }
+        }
+        validBitCount++;
+        //write 32 codes
+        if (validBitCount == 32)
+        {
+            WriteU32(dst_file, currCodeByte);
+            fwrite(dst, 1, dstPos, dst_file);
+
+            currCodeByte = 0;
+            validBitCount = 0;
+            dstPos = 0;
+        }
+    }
+    if (validBitCount > 0)
+    {
+        WriteU32(dst_file, currCodeByte);
+        fwrite(dst, 1, dstPos, dst_file);
+    }
+}
+
+// Shortest encoding as runs of up to 127 equal bytes (2 bytes each) and blocks
+// of up to 127 bytes stored as they are (1 byte plus the data)
+static void EncodeRleOptimal(FILE* dst_file, ByteView src)
+{
+    uint32_t len = src.size();
+    std::vector<uint32_t> run_len(len + 1, 0);
+    for (uint32_t pos = len; pos-- > 0;) {
+        run_len[pos] = (pos + 1 < len && src[pos] == src[pos + 1]) ? run_len[pos + 1] + 1 : 1;
+    }
+    std::vector<uint32_t> cost(len + 1, UINT32_MAX);
+    std::vector<int16_t> step(len + 1, 0); // Negative for a run
+    cost[0] = 0;
+    for (uint32_t pos = 0; pos < len; pos++) {
+        for (uint32_t n = 1; n <= 127 && pos + n <= len; n++) {
+            if (cost[pos] + n + 1 < cost[pos + n]) {
+                cost[pos + n] = cost[pos] + n + 1;
+                step[pos + n] = n;
+            }
+        }
+        for (uint32_t n = 2; n <= std::min<uint32_t>(run_len[pos], 127); n++) {
+            if (cost[pos] + 2 < cost[pos + n]) {
+                cost[pos + n] = cost[pos] + 2;
+                step[pos + n] = -(int16_t)n;
+            }
+        }
+    }
+    std::vector<int16_t> steps;
+    for (uint32_t pos = len; pos > 0; pos -= std::abs(step[pos])) {
+        steps.push_back(step[pos]);
+    }
+    uint32_t pos = 0;
+    for (auto it = steps.rbegin(); it != steps.rend(); ++it) {
+        if (*it < 0) {
+            WriteU8(dst_file, -*it);
+            WriteU8(dst_file, src[pos]);
+            pos -= *it;
+        }
+        else {
+            WriteU8(dst_file, *it | 0x80);
+            fwrite(&src[pos], 1, *it, dst_file);
+            pos += *it;
+        }
+    }
+}
+
+void EncodeRle(FILE* dst_file, ByteView src, EncodeLevel level)
+{
+    if (level == EncodeLevel::Max) {
+        EncodeRleOptimal(dst_file, src);
+        return;
+    }
+    if (src.empty()) {
+        return;
+    }
+
+    uint32_t input_pos = 0;
+    uint32_t i;
+    size_t search_len;
+    uint32_t copy_len = 0;
+    uint8_t curr_byte;
+    uint8_t next_byte;
+
+    size_t len = src.size();
+    while (input_pos < (len - 1)) {
+        curr_byte = src[input_pos];
+        next_byte = src[input_pos + 1];
+        search_len = len - input_pos - 2;
+        if (search_len > 127) {
+            search_len = 127;
+        }
+        copy_len = 1;
+        if (curr_byte == next_byte) {
+            for (i = 1; i < search_len; i++) {
+                curr_byte = src[input_pos + i];
+                next_byte = src[input_pos + i + 1];
+                if (curr_byte != next_byte) {
+                    break;
+                }
+                copy_len++;
+            }
+            WriteU8(dst_file, copy_len);
+            WriteU8(dst_file, src[input_pos]);
+            input_pos += copy_len;
+        }
+        else {
+            for (i = 1; i < search_len; i++) {
+                curr_byte = src[input_pos + i];
+                next_byte = src[input_pos + i + 1];
+                if (curr_byte == next_byte) {
+                    break;
+                }
+                copy_len++;
+            }
+            WriteU8(dst_file, copy_len | 0x80);
+            fwrite(&src[input_pos], 1, copy_len, dst_file);
+            input_pos += copy_len;
+        }
+    }
+    //Write last byte raw
+    WriteU8(dst_file, 1 | 0x80);
+    WriteU8(dst_file, src[input_pos]);
+}
+
+void EncodeData(FILE* file, uint32_t comptype, ByteView data, ThreadPool& pool, EncodeLevel level, const CodecKernels& kernels)
+{
+    WriteU32(file, data.size());
+    WriteU32(file, comptype);
+    switch (comptype) {
+    case 0:
+        EncodeNone(file, data);
+        break;
+
+    case 1:
+        EncodeLZSS(file, data, pool, level, kernels);
+        break;
+
+    case 2:
+        EncodeSlide(file, data, pool, level, kernels);
+        break;
+
+
+    case 3:
+    case 4:
+        EncodeSlide(file, data, pool, level, kernels);
+        break;
+
+    case 5:
+        EncodeRle(file, data, level);
+        break;
+
+    default:
+        throw RomError("Invalid compression type " + std::to_string(comptype) + ".");
+    }
+    WriteAlign(file, 2);
+}
+
+static void EncodeToBuffer(uint32_t comptype, ByteView data, ThreadPool& pool, EncodeLevel level, const CodecKernels& kernels, std::vector<uint8_t>& out)
+{
+    FILE* file = tmpfile();
+    if (!file) {
+        throw RomError("Failed to create a temporary file.");
+    }
+    EncodeData(file, comptype, data, pool, level, kernels);
+    out.resize(ftell(file));
+    rewind(file);
+    size_t size = fread(out.data(), 1, out.size(), file);
+    fclose(file);
+    out.resize(size);
+}
+
+// Runs, repeats and noise, so every match length gets used
+static void MakeCodecTestData(std::mt19937& rng, size_t size, std::vector<uint8_t>& data)
+{
+    while (data.size() < size) {
+        size_t kind = rng() % 3;
+        size_t len = 1 + rng() % 300;
+        for (size_t i = 0; i < len && data.size() < size; i++) {
+            if (kind == 0) {
+                data.push_back(0);
+            }
+            else if (kind == 1 && data.size() > 64) {
+                data.push_back(data[data.size() - 1 - (rng() % 8)]);
+            }
+            else {
+                data.push_back(rng() % 16);
+            }
+        }
+    }
+}
+
+bool SelfTestCpuLevels(std::string& error)
+{
+    std::mt19937 rng(1);
+    std::vector<uint8_t> buf(1024);
+    for (auto& value : buf) {
+        value = rng() % 2;
+    }
+    std::vector<uint8_t> data;
+    MakeCodecTestData(rng, 0x10000, data);
+
+    ThreadPool pool(1);
+    std::vector<std::vector<uint8_t>> expected;
+    CodecKernels scalar = GetCodecKernels(CpuLevel::Scalar);
+    for (uint32_t comptype : { 1, 2 }) {
+        for (EncodeLevel level : { EncodeLevel::Fast, EncodeLevel::Default, EncodeLevel::Max }) {
+            expected.emplace_back();
+            EncodeToBuffer(comptype, data, pool, level, scalar, expected.back());
+        }
+    }
+
+    bool success = true;
+    for (int level = (int)CpuLevel::Sse42; success && level <= (int)best_cpu_level; level++) {
+        const char* name = GetCpuLevelName((CpuLevel)level);
+        CodecKernels kernels = GetCodecKernels((CpuLevel)level);
+        for (size_t trial = 0; success && trial < 20000; trial++) {
+            // Offsets close together cover overlapping buffers
+            size_t a = rng() % 512;
+            size_t b = trial % 2 ? rng() % 512 : a + rng() % 8;
+            size_t limit = rng() % (buf.size() - std::max(a, b) + 1);
+            if (kernels.match_length(&buf[a], &buf[b], limit) != MatchLengthScalar(&buf[a], &buf[b], limit)) {
+                error = std::string("Match length differs for ") + name + " at offsets " + std::to_string(a) + " and " + std::to_string(b)
+                    + " with limit " + std::to_string(limit) + ".";
+                success = false;
+            }
+        }
+        for (uint32_t trial = 0; success && trial < 2000; trial++) {
+            uint32_t pos = 1 + rng() % (uint32_t)(buf.size() - 1);
+            uint32_t start = rng() % pos;
+            uint32_t limit = rng() % ((uint32_t)buf.size() - pos + 1);
+            uint32_t best = rng() % 4;
+            uint32_t got_pos = 0;
+            uint32_t want_pos = 0;
+            uint32_t got = kernels.longest_match(buf.data(), start, pos, limit, best, &got_pos);
+            uint32_t want = LongestMatchScalar(buf.data(), start, pos, limit, best, &want_pos);
+            if (got != want || got_pos != want_pos) {
+                error = std::string("Longest match differs for ") + name + " at position " + std::to_string(pos) + ".";
+                success = false;
+            }
+        }
+        size_t index = 0;
+        for (uint32_t comptype : { 1, 2 }) {
+            for (EncodeLevel encode_level : { EncodeLevel::Fast, EncodeLevel::Default, EncodeLevel::Max }) {
+                std::vector<uint8_t> out;
+                EncodeToBuffer(comptype, data, pool, encode_level, kernels, out);
+                if (success && out != expected[index]) {
+                    error = std::string("Encoder output differs for ") + name + " with compression type " + std::to_string(comptype) + ".";
+                    success = false;
+                }
+                index++;
+            }
+        }
+    }
+    return success;
+}
+
+// Multithreaded file data writing with reduced complexity
+void RomContext::WriteFileDataRom(FILE* file)
+{
+    size_t dircnt = gamedata.filedata.files.size();
+    size_t base_ofs = ftell(file);
+    std::vector<uint32_t> dir_ofs_all;
+    SetSegValue(gamedata.filedata.segid, base_ofs, false);
+    WriteU32(file, dircnt);
+    for (size_t i = 0; i < dircnt; i++) {
+        WriteU32(file, 0);
+    }
+
+    // Use simpler compression approach to avoid deadlocks
+    for (size_t i = 0; i < dircnt; i++) {
+        size_t dir_ofs = ftell(file);
+        size_t filecnt = gamedata.filedata.files[i].size();
+        std::vector<uint32_t> dir_file_ofs;
+        dir_ofs_all.push_back(dir_ofs - base_ofs);
+        WriteU32(file, filecnt);
+        for (size_t j = 0; j < filecnt; j++) {
+            WriteU32(file, 0);
+        }
+        for (size_t j = 0; j < filecnt; j++) {
+            FileData& filedata = gamedata.filedata.files[i][j];
+            size_t file_ofs = ftell(file);
+            dir_file_ofs.push_back(file_ofs - dir_ofs);
+            if (!filedata.encoded.empty()) {
+                // Entries start and end 2-aligned, so the cached padding still fits
+                WriteRawBuffer(file, filedata.encoded);
+            }
+            else {
+                EncodeData(file, filedata.comp_type, filedata.data, pool, encode_level, GetCodecKernels(cpu_level));
+                if (use_rebuild_cache) {
+                    // Read back for the cache; the output is opened for update
+                    size_t size = ftell(file) - file_ofs;
+                    uint8_t* encoded = arena.Allocate(size);
+                    fseek(file, file_ofs, SEEK_SET);
+                    filedata.encoded = ByteView(encoded, fread(encoded, 1, size, file));
+                    fseek(file, 0, SEEK_END);
+                }
+            }
+        }
+        for (size_t j = 0; j < filecnt; j++) {
+            WriteU32At(file, dir_file_ofs[j], dir_ofs + (j * 4) + 4);
+        }
+    }
+    for (size_t i = 0; i < dircnt; i++) {
+        WriteU32At(file, dir_ofs_all[i], base_ofs + (i * 4) + 4);
+    }
+    WriteAlign(file, 16);
+}
+
+void RomContext::WriteMessDataRom(FILE* file, MessDataSegment& messdata)
+{
+    messdata.romaddr = ftell(file);
+    SetSegValue(messdata.segid, messdata.romaddr, false);
+    if (messdata.new_format) {
+        std::vector<uint32_t> dir_ofs;
+        size_t base_ofs = ftell(file);
+        size_t dircnt = messdata.mess_dir_all.size();
+        WriteU32(file, dircnt);
+        for (size_t i = 0; i < dircnt; i++) {
+            WriteU32(file, 0);
+        }
+
+        // Use single-threaded compression for message data to avoid hanging
+        for (size_t i = 0; i < dircnt; i++) {
+            dir_ofs.push_back(ftell(file) - base_ofs);
+            EncodeData(file, 1, messdata.mess_dir_all[i].data, pool, encode_level, GetCodecKernels(cpu_level)); // LZ compression
+        }
+
+        for (size_t i = 0; i < dircnt; i++) {
+            WriteU32At(file, dir_ofs[i], base_ofs + (i * 4) + 4);
+        }
+    }
+    else {
+        WriteRawBuffer(file, messdata.full_data);
+    }
+    WriteAlign(file, 16);
+}
+
+void RomContext::WriteHvqDataRom(FILE* file)
+{
+    size_t bgcnt = gamedata.hvqdata.hvq_data.size();
+    size_t base_ofs = ftell(file);
+    gamedata.hvqdata.romaddr = base_ofs;
+    SetSegValue(gamedata.hvqdata.segid, base_ofs, false);
+    std::vector<uint32_t> bg_ofs;
+    WriteU32(file, bgcnt + 1);
+    for (size_t i = 0; i < bgcnt + 1; i++) {
+        WriteU32(file, 0);
+    }
+    for (size_t i = 0; i < bgcnt; i++) {
+        bg_ofs.push_back(ftell(file) - base_ofs);
+        WriteRawBuffer(file, gamedata.hvqdata.hvq_data[i]);
+        WriteAlign(file, 2);
+    }
+    bg_ofs.push_back(ftell(file) - base_ofs);
+    for (size_t i = 0; i < bgcnt + 1; i++) {
+        WriteU32At(file, bg_ofs[i], base_ofs + (i * 4) + 4);
+    }
+    WriteAlign(file, 16);
+}
+
+void RomContext::WriteBgAnimDataRom(FILE* file)
+{
+    size_t base_ofs = ftell(file);
+    gamedata.bganimdata.romaddr = base_ofs;
+    SetSegValue(gamedata.bganimdata.segid, base_ofs, false);
+    size_t count = gamedata.bganimdata.bganim_data.size();
+    std::vector<uint32_t> data_ofs;
+    WriteU32(file, count + 1);
+    for (size_t i = 0; i < count + 1; i++) {
+        WriteU32(file, 0);
+    }
+    for (size_t i = 0; i < count; i++) {
+        data_ofs.push_back(ftell(file) - base_ofs);
+        WriteRawBuffer(file, gamedata.bganimdata.bganim_data[i]);
+        WriteAlign(file, 2);
+    }
+    data_ofs.push_back(ftell(file) - base_ofs);
+    for (size_t i = 0; i < count + 1; i++) {
+        WriteU32At(file, data_ofs[i], base_ofs + (i * 4) + 4);
+    }
+    WriteAlign(file, 16);
+}
+
+void RomContext::WriteMusBankRom(FILE* file, MusBankSegment& musbank)
+{
+    musbank.romaddr = ftell(file);
+    SetSegValue(musbank.segid, musbank.romaddr, false);
+
+    // Generate musbank header
+    uint32_t count = musbank.libaudioseg.seqsegs.size();
+    uint32_t soundbanksize = musbank.libaudioseg.soundbankseg.data.size();
+
+    WriteRawBuffer(file, musbank.revision);
+    if (musbank.new_format) {
+        WriteU32(file, count);
+        WriteRawBuffer(file, musbank.unkdata);
+
+        uint32_t headersize = 80 + 16 * count;
+        uint32_t offset = headersize;
+        for (auto& seqseg : musbank.libaudioseg.seqsegs) {
+            uint32_t seqsize = seqseg.data.size();
+            WriteU8(file, seqseg.unk0);
+            WriteU8(file, seqseg.unk1);
+            WriteU8(file, seqseg.bank);
+            WriteU8(file, 0);
+            WriteU32(file, 0x07000000); // unused
+            if (seqseg.id == -1) { // original data
+                seqseg.romaddr = offset;
+                WriteU32(file, offset);
+                WriteU32(file, seqseg.data.size());
+                offset += seqseg.data.size();
+                offset = BIT_ALIGN(offset, 8);
+            }
+            else {
+                // Write copy sequence data
+                auto& copyseqseg = musbank.libaudioseg.seqsegs[seqseg.id];
+                WriteU32(file, copyseqseg.romaddr);
+                WriteU32(file, copyseqseg.data.size());
+            }
+        }
+
+        WriteU32(file, offset);
+        WriteU32(file, soundbanksize);
+        WriteU32(file, offset + soundbanksize);
+        WriteU32(file, musbank.libaudioseg.wavetableseg.data.size());
+    }
+    else {
+        WriteU16(file, count);
+        uint32_t headersize = 4 + count * 24;
+        headersize = BIT_ALIGN(headersize, 16); // padding
+        uint32_t offset = soundbanksize + headersize + musbank.libaudioseg.wavetableseg.data.size();
+        for (auto& seqseg : musbank.libaudioseg.seqsegs) {
+            if (seqseg.id == -1) { // original data
+                uint32_t seqsize = seqseg.data.size();
+                seqseg.romaddr = offset;
+                WriteU32(file, offset);
+                WriteU32(file, seqsize);
+                seqsize = BIT_ALIGN(seqsize, 8); // Don't forget about the padding
+                offset += seqsize;
+            }
+            else {
+                auto& copyseqseg = musbank.libaudioseg.seqsegs[seqseg.id];
+                WriteU32(file, copyseqseg.romaddr);
+                WriteU32(file, copyseqseg.data.size());
+            }
+        }
+        for (auto& seqseg : musbank.libaudioseg.seqsegs) {
+            uint32_t seqsize = seqseg.data.size();
+            WriteU8(file, seqseg.bank);
+            WriteU8(file, 0x7F); // unused
+            WriteU8(file, 0xFF); // unused
+            WriteU8(file, 0xFF); // unused
+
+            WriteU32(file, headersize);
+            WriteU32(file, soundbanksize);
+            WriteU32(file, headersize + soundbanksize);
+        }
+    }
+    WriteAlignFF(file, 16);
+
+    // midi order is first for new_format
+    if (musbank.new_format) {
+        for (auto& seq : musbank.libaudioseg.seqsegs) {
+            if (seq.id == -1) {
+                WriteRawBuffer(file, seq.data);
+                WriteAlign(file, 8);
+            }
+        }
+    }
+    WriteRawBuffer(file, musbank.libaudioseg.soundbankseg.data);
+    WriteRawBuffer(file, musbank.libaudioseg.wavetableseg.data);
+    if (!musbank.new_format) {
+        for (auto& seq : musbank.libaudioseg.seqsegs) {
+            if (seq.id == -1) {
+                WriteRawBuffer(file, seq.data);
+                WriteAlign(file, 8); // Already aligned in mp1, this is for custom data
+            }
+        }
+    }
+    WriteAlign(file, 16);
+    SetSegValue(musbank.segid, ftell(file), true);
+}
+
+void RomContext::WriteSfxBankRom(FILE* file, SfxBankSegment& sfxbank)
+{
+    sfxbank.romaddr = ftell(file);
+    SetSegValue(sfxbank.segid, sfxbank.romaddr, false);
+    WriteRawBuffer(file, sfxbank.header);
+    size_t records_ofs = sfxbank.header.size();
+    for (size_t i = 0; i < sfxbank.entries.size(); i++) {
+        WriteU32(file, 0);
+        WriteU32(file, 0);
+    }
+
+    // Entries stay where they were unless an earlier one grew into them, so
+    // editing one entry leaves the others untouched. The bytes that preceded
+    // an entry are written in front of it; unused records are kept as they were
+    size_t offset = ftell(file) - sfxbank.romaddr;
+    for (size_t i : GetSfxBankLayout(sfxbank)) {
+        SfxBankEntry& entry = sfxbank.entries[i];
+        WriteRawBuffer(file, entry.gap);
+        offset += entry.gap.size();
+        if (entry.offset < offset) {
+            entry.offset = BIT_ALIGN(offset, 16);
+        }
+        while (offset < entry.offset) {
+            WriteU8(file, 0);
+            offset++;
+        }
+        WriteRawBuffer(file, entry.data);
+        offset += entry.data.size();
+    }
+    for (size_t i = 0; i < sfxbank.entries.size(); i++) {
+        WriteU32At(file, sfxbank.entries[i].offset, sfxbank.romaddr + records_ofs + (i * 8));
+        WriteU32At(file, sfxbank.entries[i].data.size(), sfxbank.romaddr + records_ofs + (i * 8) + 4);
+    }
+    WriteAlign(file, 16);
+    SetSegValue(sfxbank.segid, ftell(file), true);
+}
+
+void RomContext::WriteFxDataRom(FILE* file)
+{
+    gamedata.fxdata.romaddr = ftell(file);
+    SetSegValue(gamedata.fxdata.segid, gamedata.fxdata.romaddr, false);
+    WriteRawBuffer(file, gamedata.fxdata.header);
+    WriteU32At(file, gamedata.fxdata.records.size(), gamedata.fxdata.romaddr + 4);
+    for (auto& record : gamedata.fxdata.records) {
+        WriteRawBuffer(file, record);
+    }
+    WriteAlign(file, 16);
+    SetSegValue(gamedata.fxdata.segid, ftell(file), true);
+}
+
+void RomContext::WriteNewSegRefs(FILE* file)
+{
+    for (size_t i = 0; i < gamedata.segrefs.size(); i++) {
+        SegRef& segref = gamedata.segrefs[i];
+        uint32_t hi_dst = segref.hi;
+        uint32_t lo_dst = segref.lo;
+        uint32_t value = segref.value;
+        uint16_t lo = value & 0xFFFF;
+        uint16_t hi = (value >> 16);
+        if (lo > 0x8000) {
+            hi++;
+        }
+        WriteU16At(file, hi, hi_dst);
+        WriteU16At(file, lo, lo_dst);
+    }
+}
+
+void RomContext::WriteRom(std::string output)
+{
+    FILE* file = fopen(output.c_str(), "w+b");
+    if (!file) {
+        throw RomError("Failed to open " + output + " for writing.");
+    }
+    size_t initial_size = gamedata.filedata.romaddr;
+    //Copy Initial Section of ROM
+    fwrite(&rom_data[0], 1, initial_size, file);
+    WriteFileDataRom(file);
+    for (size_t i = 0; i < gamedata.messdata_all.size(); i++) {
+        WriteMessDataRom(file, gamedata.messdata_all[i]);
+    }
+
+    WriteHvqDataRom(file);
+    if (game_id == "mp2") {
+        WriteBgAnimDataRom(file);
+    }
+    for (size_t i = 0; i < gamedata.musbanks.size(); i++) {
+        WriteMusBankRom(file, gamedata.musbanks[i]);
+    }
+    for (size_t i = 0; i < gamedata.sfxbanks.size(); i++) {
+        WriteSfxBankRom(file, gamedata.sfxbanks[i]);
+    }
+    WriteFxDataRom(file);
+    WriteNewSegRefs(file);
+    std::string romid = ReadRomGameID();
+    //Wrong Save Type Hang/Initialization Fix
+    if (romid == "NMVE") {
+        WriteU32At(file, 0, 0xCEC0);
+        WriteU32At(file, 0, 0x50950);
+    }
+    else if (romid == "NMVP") {
+        WriteU32At(file, 0, 0xCEE0);
+        WriteU32At(file, 0, 0x50990);
+    }
+    else if (romid == "NMVJ") {
+        WriteU32At(file, 0, 0xCEC0);
+        WriteU32At(file, 0, 0x507EC);
+    }
+    fclose(file);
+}
+
+#include "crc.inc"
+
+// fix_crc regenerates a shared CRC table on every call
+std::mutex crc_mutex;
+
+void RomContext::SaveRebuildCache(std::string path)
+{
+    // Written under a temporary name so an interrupted save never leaves a
+    // cache that loads but is cut short
+    std::string temp_path = path + ".tmp";
+    FILE* file = fopen(temp_path.c_str(), "wb");
+    if (!file) {
+        throw RomError("Failed to open " + temp_path + " for writing.");
+    }
+    size_t count = 0;
+    for (const auto& dir : gamedata.filedata.files) {
+        count += dir.size();
+    }
+    WriteU32(file, REBUILD_CACHE_MAGIC);
+    WriteU32(file, REBUILD_CACHE_VERSION);
+    WriteU32(file, count);
+    for (auto& dir : gamedata.filedata.files) {
+        for (FileData& filedata : dir) {
+            const FileStamp& stamp = filedata.stamp;
+            WriteU32(file, stamp.path.size());
+            fwrite(stamp.path.data(), 1, stamp.path.size(), file);
+            WriteU32(file, stamp.size >> 32);
+            WriteU32(file, stamp.size);
+            WriteU32(file, (uint64_t)stamp.mtime >> 32);
+            WriteU32(file, stamp.mtime);
+            WriteU32(file, stamp.hash >> 32);
+            WriteU32(file, stamp.hash);
+            WriteU32(file, filedata.comp_type);
+            WriteU32(file, (uint32_t)encode_level);
+            WriteU32(file, filedata.encoded.size());
+            WriteRawBuffer(file, filedata.encoded);
+        }
+    }
+    bool write_error = ferror(file) != 0;
+    if (fclose(file) != 0 || write_error) {
+        remove(temp_path.c_str());
+        throw RomError("Failed to write " + temp_path + ".");
+    }
+    remove(path.c_str());
+    if (rename(temp_path.c_str(), path.c_str()) != 0) {
+        throw RomError("Failed to rename " + temp_path + " to " + path + ".");
+    }
+}
+
+void RomContext::RebuildRom(std::string indir, std::string output)
+{
+    ResetGameData();
+    // Cached file data is used in place, so the cache outlives the write
+    RebuildCache cache;
+    if (use_rebuild_cache) {
+        cache.Load(output + ".cache");
+        ParseRomData(indir + "/romdata.xml", &cache);
+    }
+    else {
+        ParseRomData(indir + "/romdata.xml", nullptr);
+    }
+    WriteRom(output);
+    if (use_rebuild_cache) {
+        SaveRebuildCache(output + ".cache");
+    }
+    std::lock_guard<std::mutex> lock(crc_mutex);
+    fix_crc(output.c_str());
+}
+
+bool RomContext::RunGuarded(const std::function<void()>& func)
+{
+    try {
+        func();
+    }
+    catch (const std::exception& e) {
+        error = e.what();
+        return false;
+    }
+    error.clear();
+    return true;
+}
+
+bool RomContext::Load(std::string rom_path)
+{
+    return RunGuarded([this, rom_path]() {
+        // Parsed data points into the ROM being replaced
+        desc = nullptr;
+        rom_parsed = false;
+        LoadROM(rom_path);
+        ReadGameDesc(ReadRomGameID());
+        });
+}
+
+bool RomContext::Parse()
+{
+    return RunGuarded([this]() {
+        ResetGameData();
+        ParseGameDataRom();
+        rom_parsed = true;
+        });
+}
+
+bool RomContext::Extract(std::string outdir)
+{
+    return RunGuarded([this, outdir]() {
+        if (!rom_parsed) {
+            ResetGameData();
+            ParseGameDataRom();
+            rom_parsed = true;
+        }
+        DumpGameData(outdir);
+        });
+}
+
+bool RomContext::Rebuild(std::string indir, std::string output)
+{
+    return RunGuarded([this, indir, output]() {
+        RebuildRom(indir, output);
+        });
+}
+
+// The original LZ decoder, which mirrors every byte into the window and reads
+// references back from it. Kept as the reference DecodeLZ is checked against
+static size_t DecodeLZWindowed(const std::vector<uint8_t>& src, std::vector<uint8_t>& data)
+{
+    auto read8 = [&src](size_t offset) -> uint8_t {
+        return offset < src.size() ? src[offset] : 0;
+    };
+    size_t raw_size = ((size_t)read8(0) << 24) | (read8(1) << 16) | (read8(2) << 8) | read8(3);
+    size_t offset = 8;
+    uint8_t window[LZ_WINDOW_SIZE];
+    uint32_t window_ofs = LZ_WINDOW_OFS;
+    uint16_t flag = 0;
+    memset(window, 0, LZ_WINDOW_SIZE);
+    data.clear();
+    data.reserve(raw_size);
+    while (raw_size > 0) {
+        flag >>= 1;
+        if (!(flag & 0x100)) {
+            flag = 0xFF00 | read8(offset++);
+        }
+        if (flag & 0x1) {
+            uint8_t value = read8(offset++);
+            data.push_back(value);
+            window[window_ofs++] = value;
+            window_ofs %= LZ_WINDOW_SIZE;
+            raw_size--;
+        }
+        else {
+            uint32_t i;
+            uint8_t byte1 = read8(offset++);
+            uint8_t byte2 = read8(offset++);
+            uint32_t ofs = ((byte2 & 0xC0) << 2) | byte1;
+            uint32_t copy_len = std::min<size_t>((byte2 & 0x3F) + 3, raw_size);
+            for (i = 0; i < copy_len; i++) {
+                uint8_t value = window[(ofs + i) % LZ_WINDOW_SIZE];
+                data.push_back(value);
+                window[window_ofs++] = value;
+                window_ofs %= LZ_WINDOW_SIZE;
+            }
+            raw_size -= i;
+        }
+    }
+    size_t comp_size = offset - 8;
+    return BIT_ALIGN(comp_size, 2) + 8;
+}
+
+// Decodes the entry at the start of src with fast_decode and with a
+// StreamDecoder fed piece_size bytes at a time; both must agree on the output
+// and on the compressed size, and match expected when given. LZ entries must
+// also match the original windowed decoder
+static void CompareDecoders(const std::vector<uint8_t>& src, const std::function<size_t(std::vector<uint8_t>&)>& fast_decode,
+    size_t piece_size, const std::vector<uint8_t>* expected, const std::string& what)
+{
+    std::vector<uint8_t> fast;
+    size_t fast_size = 0;
+    std::string fast_error;
+    try {
+        fast_size = fast_decode(fast);
+    }
+    catch (const RomError& e) {
+        fast_error = e.what();
+    }
+    std::vector<uint8_t> ref;
+    size_t ref_size = 0;
+    std::string ref_error;
+    try {
+        StreamDecoder decoder(src.data(), src.size(), 0);
+        ref.resize(decoder.GetRawSize());
+        size_t pos = 0;
+        while (!decoder.Done()) {
+            pos += decoder.DecodeSome(ref.data() + pos, std::min(piece_size, ref.size() - pos));
+        }
+        ref_size = decoder.GetCompSize();
+    }
+    catch (const RomError& e) {
+        ref_error = e.what();
+    }
+    if (fast_error != ref_error) {
+        throw RomError(what + ": decoders fail differently (\"" + fast_error + "\" and \"" + ref_error + "\").");
+    }
+    if (!fast_error.empty()) {
+        return;
+    }
+    if (fast != ref) {
+        size_t index = 0;
+        while (index < fast.size() && fast[index] == ref[index]) {
+            index++;
+        }
+        throw RomError(what + ": decoders differ at output byte " + std::to_string(index) + ".");
+    }
+    if (fast_size != ref_size) {
+        throw RomError(what + ": decoders read " + std::to_string(fast_size) + " and " + std::to_string(ref_size) + " bytes.");
+    }
+    if (src.size() >= 8 && src[4] == 0 && src[5] == 0 && src[6] == 0 && src[7] == 1) {
+        std::vector<uint8_t> windowed;
+        size_t windowed_size = DecodeLZWindowed(src, windowed);
+        if (fast != windowed) {
+            throw RomError(what + ": LZ output differs from the windowed decoder.");
+        }
+        if (fast_size != windowed_size) {
+            throw RomError(what + ": windowed LZ decoder read " + std::to_string(windowed_size) + " bytes, not " + std::to_string(fast_size) + ".");
+        }
+    }
+    if (expected && fast != *expected) {
+        throw RomError(what + ": decoded data differs from the encoder input.");
+    }
+    if (expected && fast_size != src.size()) {
+        throw RomError(what + ": decoders read " + std::to_string(fast_size) + " of " + std::to_string(src.size()) + " encoded bytes.");
+    }
+}
+
+bool CheckCodecInput(const uint8_t* data, size_t size, std::string& error)
+{
+    static ThreadPool pool(1);
+    static GameDescCache desc_cache;
+    if (size < 3) {
+        return true;
+    }
+    // Byte 0 picks the compression type (including unsupported ones) and the
+    // stream piece size, bytes 1-2 the raw size; the rest is the stream and
+    // also the data to round-trip
+    uint32_t comptype = data[0] & 0x7;
+    size_t piece_size = 1 + (data[0] >> 3);
+    uint32_t raw_size = (data[1] << 8) | data[2];
+    std::vector<uint8_t> payload(data + 3, data + size);
+
+    RomContext ctx(pool, desc_cache, "");
+    auto fast_decode = [&ctx](std::vector<uint8_t>& out) {
+        ByteView data;
+        size_t size = ctx.DecodeData(0, data);
+        out.assign(data.begin(), data.end());
+        return size;
+    };
+    try {
+        uint8_t header[8] = { 0, 0, (uint8_t)(raw_size >> 8), (uint8_t)raw_size, 0, 0, 0, (uint8_t)comptype };
+        ctx.rom_data.assign(header, header + 8);
+        ctx.rom_data.insert(ctx.rom_data.end(), payload.begin(), payload.end());
+        CompareDecoders(ctx.rom_data, fast_decode, piece_size, nullptr, "Compression type " + std::to_string(comptype));
+
+        if (payload.size() > 0x10000) {
+            payload.resize(0x10000);
+        }
+        for (uint32_t type : { 0, 1, 2, 5 }) {
+            for (EncodeLevel level : { EncodeLevel::Fast, EncodeLevel::Default, EncodeLevel::Max }) {
+                std::string what = "Compression type " + std::to_string(type) + " level " + std::to_string((int)level);
+                EncodeToBuffer(type, payload, pool, level, GetCodecKernels(ctx.cpu_level), ctx.rom_data);
+                CompareDecoders(ctx.rom_data, fast_decode, piece_size, &payload, what);
+                // Cut short, the stream reads zeros past its end
+                ctx.rom_data.resize(8 + (ctx.rom_data.size() - 8) * data[1] / 256);
+                CompareDecoders(ctx.rom_data, fast_decode, piece_size, nullptr, what + " truncated");
+            }
+        }
+    }
+    catch (const RomError& e) {
+        error = e.what();
+        return false;
+    }
+    return true;
+}
+
+bool CheckCodecSeeded(uint32_t seed, size_t count, std::string& error)
+{
+    static ThreadPool pool(1);
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> input;
+    for (size_t i = 0; i < count; i++) {
+        std::vector<uint8_t> data;
+        MakeCodecTestData(rng, rng() % 0x1000, data);
+        uint32_t comptype = rng() % 8;
+        input.assign(3, 0);
+        input[0] = (uint8_t)((rng() % 32) << 3 | comptype);
+        if (comptype == 0 || comptype > 5 || rng() % 4 == 0) {
+            // Arbitrary bytes under an arbitrary raw size
+            input[1] = (uint8_t)rng();
+            input[2] = (uint8_t)rng();
+            input.insert(input.end(), data.begin(), data.end());
+        }
+        else {
+            // A real stream with a few bytes corrupted, after its own raw size
+            std::vector<uint8_t> encoded;
+            try {
+                EncodeToBuffer(comptype, data, pool, EncodeLevel::Fast, GetCodecKernels(GetCpuLevel()), encoded);
+            }
+            catch (const RomError& e) {
+                error = e.what();
+                return false;
+            }
+            input[1] = encoded[2];
+            input[2] = encoded[3];
+            input.insert(input.end(), encoded.begin() + 8, encoded.end());
+            size_t flips = rng() % 4;
+            for (size_t j = 0; j < flips && input.size() > 3; j++) {
+                input[3 + rng() % (input.size() - 3)] ^= (uint8_t)(1 << (rng() % 8));
+            }
+        }
+        if (!CheckCodecInput(input.data(), input.size(), error)) {
+            error = "Seed " + std::to_string(seed) + " input " + std::to_string(i) + ": " + error;
+            return false;
+        }
+    }
+    return true;
+}
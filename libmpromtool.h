@@ -0,0 +1,530 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <map>
+#include <list>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <condition_variable>
+#include <exception>
+#include <stdexcept>
+
+namespace tinyxml2 {
+class XMLDocument;
+class XMLElement;
+class XMLPrinter;
+}
+
+class SharedDataPaths;
+class RebuildCache;
+
+// Non-owning view of asset bytes, which live in the loaded ROM, the arena of
+// a RomContext or a caller's buffer
+class ByteView {
+public:
+    ByteView() = default;
+    ByteView(const uint8_t* data, size_t size) : ptr(data), length(size) {}
+    ByteView(const std::vector<uint8_t>& data) : ptr(data.data()), length(data.size()) {}
+    const uint8_t* data() const { return ptr; }
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    const uint8_t& operator[](size_t index) const { return ptr[index]; }
+    const uint8_t* begin() const { return ptr; }
+    const uint8_t* end() const { return ptr + length; }
+    bool operator==(const ByteView& other) const
+    {
+        return length == other.length && (length == 0 || memcmp(ptr, other.ptr, length) == 0);
+    }
+
+private:
+    const uint8_t* ptr = nullptr;
+    size_t length = 0;
+};
+
+// Bump allocator holding the asset bytes of one parse or rebuild. Blocks are
+// not zero-filled and are only released all at once by Clear().
+class ByteArena {
+public:
+    uint8_t* Allocate(size_t size);
+    void Clear();
+
+private:
+    std::mutex mutex;
+    std::vector<std::unique_ptr<uint8_t[]>> slabs;
+    uint8_t* next = nullptr;
+    size_t remaining = 0;
+};
+
+// Decoded file data. Holding it keeps the bytes alive after the decode cache
+// has dropped them.
+struct DecodedData {
+    std::shared_ptr<const uint8_t> owner; // Null when data points into the ROM
+    ByteView data;
+};
+
+// Recently decoded file data of one RomContext. Once the total size passes
+// the limit, the least recently used entries are dropped.
+class DecodeCache {
+public:
+    bool Find(uint32_t key, DecodedData& data);
+    void Insert(uint32_t key, const DecodedData& data, size_t limit);
+    void Clear();
+
+private:
+    struct Entry {
+        uint32_t key;
+        DecodedData data;
+    };
+
+    std::mutex mutex;
+    std::list<Entry> entries; // Most recently used first
+    std::map<uint32_t, std::list<Entry>::iterator> by_key;
+    size_t size = 0;
+};
+
+// State of an extracted file, recorded in the rebuild cache
+struct FileStamp {
+    std::string path;
+    uint64_t size = 0;
+    int64_t mtime = 0; // Nanoseconds since the epoch, whole seconds on Windows
+    uint64_t hash = 0;
+};
+
+struct FileData {
+    uint16_t dir;
+    uint16_t file;
+    uint32_t comp_type;
+    uint32_t raw_size = 0; // Parse only
+    uint32_t romaddr = 0; // Header of compressed data decoded on first use, 0 when data holds the file
+    ByteView data; // Stored data in the ROM or the file read for a rebuild
+    FileStamp stamp; // Rebuild only
+    ByteView encoded; // Encoder output taken from the rebuild cache, in which case data is not read
+};
+struct FileDataSegment {
+    std::string segname;
+    uint32_t romaddr = 0;
+    int segid = -1;
+    std::vector<std::string> datadir_names; // Indexed by directory, empty when unnamed
+    std::vector<std::vector<FileData>> files;
+};
+
+struct MessDataDir {
+    uint16_t id;
+    ByteView data;
+};
+struct MessDataSegment {
+    std::string segname;
+    int segid = -1;
+    bool use_dirmap = false;
+    uint32_t romaddr = 0;
+    bool new_format = false;
+    std::vector<MessDataDir> mess_dir_all; //Only used if new_format == true
+    ByteView full_data; //Only used if new_format == false
+};
+
+struct HvqDataSegment {
+    std::string segname;
+    uint32_t romaddr = 0;
+    int segid = -1;
+    std::vector<std::string> hvqbg_names;
+    std::vector<ByteView> hvq_data;
+};
+
+struct BgAnimDataSegment {
+    std::string segname;
+    uint32_t romaddr = 0;
+    int segid = -1;
+    std::vector<std::string> bganim_names;
+    std::vector<ByteView> bganim_data;
+};
+
+
+struct SoundBankSegment
+{
+    std::string segname;
+    uint32_t romaddr = 0;
+    uint32_t size = 0;
+    ByteView data;
+};
+
+struct WaveTableSegment
+{
+    std::string segname;
+    uint32_t romaddr = 0;
+    uint32_t size = 0;
+    ByteView data;
+};
+
+struct SequenceSegment
+{
+    std::string segname;
+    uint8_t unk0 = 0;    // TODO: new_format
+    uint8_t unk1 = 0;    // TODO: new_format
+    uint8_t bank = 0;
+    int16_t id = -1;      // Some entries are copies
+    uint32_t romaddr = 0;
+    uint32_t size = 0;
+    ByteView data;
+};
+
+struct LibAudioSegment {
+    std::string segname;
+    uint32_t romaddr = 0;
+    SoundBankSegment soundbankseg;
+    WaveTableSegment wavetableseg;
+    std::vector<SequenceSegment> seqsegs;
+};
+
+struct MusBankSegment {
+    std::string segname;
+    int segid = -1;
+    uint32_t romaddr = 0;
+    bool new_format = false;
+    std::vector<uint8_t> revision;
+    std::vector<uint8_t> unkdata; // TODO: new_format
+    LibAudioSegment libaudioseg;
+};
+
+struct SfxBankEntry {
+    uint32_t offset = 0; // Offset from the bank start, kept on rebuild while the entries before it still fit
+    ByteView data;
+    ByteView gap; // Bytes between the previous entry (or the record table) and this one
+};
+
+struct SfxBankSegment {
+    std::string segname;
+    int segid = -1;
+    uint32_t romaddr = 0;
+    bool new_format = false;
+    ByteView header; // Everything before the entry table
+    std::vector<SfxBankEntry> entries;
+};
+
+struct FXDataSegment {
+    std::string segname;
+    int segid = -1;
+    uint32_t romaddr = 0;
+    ByteView header; // Record count is refreshed on rebuild
+    std::vector<ByteView> records;
+};
+
+struct SegRef {
+    std::string segname;
+    unsigned int hi = 2;
+    unsigned int lo = 6;
+    uint32_t value = 0;
+    bool end = false;
+};
+
+// References of one segment, as indices into GameData::segrefs
+struct SegRefIndex {
+    std::string segname;
+    std::vector<size_t> start_refs;
+    std::vector<size_t> end_refs;
+};
+
+struct GameData {
+    std::string game;
+    FileDataSegment filedata;
+    std::vector<MessDataSegment> messdata_all;
+    std::vector<std::string> messdir_names;
+    HvqDataSegment hvqdata;
+    BgAnimDataSegment bganimdata;
+    std::vector<MusBankSegment> musbanks;
+    std::vector <SfxBankSegment> sfxbanks;
+    FXDataSegment fxdata;
+    std::map<std::string, uint32_t> segaddrs;
+    std::vector<SegRef> segrefs;
+    std::vector<SegRefIndex> segref_index; // Indexed by the segid of each segment
+};
+
+// Instruction sets the codec kernels are built for, in increasing order
+enum class CpuLevel {
+    Scalar,
+    Sse42,
+    Avx2,
+    Avx512,
+};
+
+// Most capable level this CPU and OS support
+CpuLevel GetBestCpuLevel();
+// Level new RomContexts encode with, the best supported one unless overridden
+CpuLevel GetCpuLevel();
+// Fails if this CPU does not support the level. Contexts that already exist
+// keep the level they were created with.
+bool SetCpuLevel(CpuLevel level);
+const char* GetCpuLevelName(CpuLevel level);
+// Checks every supported level against the scalar kernels, both directly and
+// through the encoders, leaving the first difference in error
+bool SelfTestCpuLevels(std::string& error);
+// Differential codec check of one fuzzer input: decodes it as a compressed
+// entry with both DecodeData and StreamDecoder, then round-trips it through
+// every encoder at every level. Never crashes or hangs on hostile input.
+bool CheckCodecInput(const uint8_t* data, size_t size, std::string& error);
+// Runs CheckCodecInput over count inputs generated from seed, mostly real
+// streams with a few bytes corrupted
+bool CheckCodecSeeded(uint32_t seed, size_t count, std::string& error);
+
+// Trade-off between encoder speed and output size on rebuild
+enum class EncodeLevel {
+    Fast, // Greedy parses over a shallow match search, for quick test builds
+    Default, // The parses the encoders have always produced
+    Max, // Smallest output, at the cost of encode time
+};
+
+// How extraction writes its files
+enum class WriterBackend {
+    Pool, // Blocking fopen/fwrite/fclose calls spread over the thread pool
+    Uring, // Batched openat/write/close chains through io_uring, Linux only
+};
+
+// An unsupported backend is replaced by Pool when a writer is created
+bool IsWriterBackendSupported(WriterBackend backend);
+
+// One entry of a ROM inventory, read from headers without decoding whole entries
+struct AssetInfo {
+    std::string type;       // Asset type as used by RomContext::GetAsset
+    std::string name;
+    size_t group = 0;       // Directory or music bank index
+    size_t index = 0;
+    uint32_t romaddr = 0;
+    uint32_t comp_type = 0;
+    uint32_t rom_size = 0;
+    uint32_t raw_size = 0;
+    std::string extension;
+};
+
+// Resumable decoder for one compressed data entry (raw size, comptype, data).
+// Each DecodeSome call continues where the last one stopped, so callers can
+// stop after a prefix or stream the output through a small buffer.
+class StreamDecoder {
+public:
+    StreamDecoder(const uint8_t* src, size_t src_size, size_t offset);
+    // Returns the number of bytes written to out, 0 once the entry is complete
+    size_t DecodeSome(uint8_t* out, size_t max_bytes);
+    bool Done() const { return raw_remaining == 0; }
+    uint32_t GetRawSize() const { return raw_size; }
+    uint32_t GetCompType() const { return comp_type; }
+    // Size of the entry in ROM including its header, valid once Done()
+    size_t GetCompSize() const;
+
+private:
+    uint8_t ReadSrc8() { return src_ofs < src_size ? src[src_ofs++] : (src_ofs++, 0); }
+    size_t DecodeSomeLZ(uint8_t* out, size_t max_bytes);
+    size_t DecodeSomeSlide(uint8_t* out, size_t max_bytes);
+    size_t DecodeSomeRle(uint8_t* out, size_t max_bytes);
+
+    const uint8_t* src;
+    size_t src_size;
+    size_t src_start;
+    size_t src_ofs;
+    uint32_t raw_size;
+    uint32_t comp_type;
+    size_t raw_remaining;
+    size_t produced = 0;
+    size_t copy_remaining = 0;  // Bytes left in the current match or run
+    uint32_t copy_ofs = 0;
+    bool copy_literal = false;  // RLE run of stored bytes rather than one repeated byte
+    uint8_t copy_value = 0;
+    uint32_t mask = 0;          // LZ flag byte or Slide flag word
+    uint32_t num_bits = 0;
+    uint32_t window_ofs = 958;
+    std::vector<uint8_t> window;  // LZ window or Slide history
+};
+
+// Fixed set of worker threads shared by every job in the process
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned int num_threads);
+    ~ThreadPool();
+    void Submit(std::function<void()> task);
+    bool RunPendingTask();
+
+private:
+    void WorkerLoop();
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool stop = false;
+};
+
+// Set of tasks submitted to a ThreadPool that can be waited on together.
+// Waiting threads run queued tasks themselves so nested groups never starve the pool.
+// Exceptions thrown by a task are rethrown from Wait().
+class TaskGroup {
+public:
+    explicit TaskGroup(ThreadPool& pool) : pool(pool) {}
+    ~TaskGroup() { WaitPending(); }
+    void Run(std::function<void()> task);
+    void Wait();
+
+private:
+    void WaitPending();
+
+    ThreadPool& pool;
+    size_t pending = 0;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+
+// Game descriptions parsed once per file and shared read-only between jobs
+class GameDescCache {
+public:
+    // Returns null if the file cannot be loaded
+    std::shared_ptr<const GameData> Get(const std::string& desc_file);
+    // Returns null for game IDs without a description compiled in
+    std::shared_ptr<const GameData> GetBuiltin(const std::string& gameid);
+
+private:
+    std::mutex mutex;
+    std::map<std::string, std::shared_ptr<const GameData>> descs;
+};
+
+// Error raised by the library internals and reported through RomContext::GetError
+class RomError : public std::runtime_error {
+public:
+    explicit RomError(const std::string& message) : std::runtime_error(message) {}
+};
+
+// State for extracting or rebuilding a single ROM. Contexts share nothing
+// but the pool and description cache, so any number can run in parallel.
+class RomContext {
+public:
+    // Game descriptions in desc_path override the built-in ones; it may be empty
+    RomContext(ThreadPool& pool, GameDescCache& desc_cache, std::string desc_path)
+        : desc_path(desc_path), pool(pool), desc_cache(desc_cache) {}
+
+    // All calls return false on failure and leave the reason in GetError()
+    bool Load(std::string rom_path);
+    bool Parse();
+    bool Extract(std::string outdir);
+    bool Rebuild(std::string indir, std::string output);
+    // Decode one asset straight from the loaded ROM: filedata:<dir>/<file>,
+    // hvq:<index>, bganim:<index> or seq:<musbank>/<index>
+    bool GetAsset(std::string spec, std::vector<uint8_t>& data);
+    // Same as above, handing the asset to writer in pieces as it is decoded
+    bool GetAsset(std::string spec, const std::function<void(const uint8_t*, size_t)>& writer);
+    bool List(std::vector<AssetInfo>& assets);
+    // Decoded data of one file after Parse, from the decode cache if it was
+    // used recently; it stays valid while held
+    bool GetFileData(size_t dir, size_t file, DecodedData& data);
+    const std::string& GetError() const { return error; }
+
+    std::string desc_path;
+    std::string game_id;
+    std::vector<uint8_t> rom_data;
+    GameData gamedata;
+    EncodeLevel encode_level = EncodeLevel::Default;
+    // Codec kernels used when encoding; levels the CPU lacks use the best supported one
+    CpuLevel cpu_level = GetCpuLevel();
+    WriterBackend writer_backend = WriterBackend::Pool;
+    // Rebuild keeps encoded file data in <output>.cache and reuses it for
+    // files whose stat data or content is unchanged
+    bool use_rebuild_cache = true;
+    // Bytes of decoded file data kept for reuse after Parse
+    size_t decode_cache_limit = 64 << 20;
+
+private:
+    friend bool CheckCodecInput(const uint8_t* data, size_t size, std::string& error);
+
+    bool RunGuarded(const std::function<void()>& func);
+    void LoadROM(std::string path);
+    std::string ReadRomGameID();
+    void ReadGameDesc(std::string gameid);
+    void ResetGameData();
+    void RebuildRom(std::string indir, std::string output);
+
+    uint8_t ReadRom8(uint32_t offset);
+    uint16_t ReadRom16(uint32_t offset);
+    uint32_t ReadRom32(uint32_t offset);
+    void ResolveGameDesc();
+    bool CheckSegRefs();
+    uint32_t GetSegValue(int segid);
+    void SetSegValue(int segid, uint32_t value, bool end);
+
+    size_t DecodeNone(size_t offset, size_t raw_size, uint8_t* dst);
+    size_t DecodeLZ(size_t offset, size_t raw_size, uint8_t* dst);
+    size_t DecodeSlide(size_t offset, size_t raw_size, uint8_t* dst);
+    size_t DecodeRle(size_t offset, size_t raw_size, uint8_t* dst);
+    size_t DecodeEntry(size_t offset, uint8_t* dst);
+    size_t DecodeData(size_t offset, ByteView& data);
+    DecodedData LoadFileData(const FileData& file, bool keep = true);
+    std::string GetDataExtensionRom(size_t offset);
+
+    void ParseFileDataRom();
+    void ParseMessDataRom(MessDataSegment& messdata);
+    void ParseHvqDataRom();
+    void ParseBgAnimDataRom();
+    void CheckRomRange(size_t offset, size_t size);
+    ByteView GetRomView(size_t offset, size_t size);
+    ByteView ReadArenaFile(const std::string& path);
+    void LibAudioDataRom(LibAudioSegment& libaudioseg);
+    uint32_t GetSeqCountRom(const MusBankSegment& musbank);
+    void ReadSeqHeaderRom(const MusBankSegment& musbank, uint32_t count, uint32_t index, SequenceSegment& seqseg);
+    void ParseMusBankDataRom(MusBankSegment& musbank);
+    size_t GetSfxBankSizeRom(const SfxBankSegment& sfxbank);
+    void ParseSfxBankData(SfxBankSegment& sfxbank, const uint8_t* data, size_t size);
+    void ParseSfxBankDataRom(SfxBankSegment& sfxbank);
+    void ParseFXDataRom();
+    void ParseFXData(const uint8_t* data, size_t size);
+    void ParseGameDataRom();
+
+    void GetFileDataRom(size_t dir, size_t file, const std::function<void(const uint8_t*, size_t)>& writer);
+    void GetTableEntryRom(size_t romaddr_base, size_t index, const std::function<void(const uint8_t*, size_t)>& writer);
+    void GetSequenceRom(size_t bank, size_t index, const std::function<void(const uint8_t*, size_t)>& writer);
+    uint32_t GetSegmentEndRom(uint32_t romaddr);
+    void ListRom(std::vector<AssetInfo>& assets);
+
+    std::string GetDataDirName(uint16_t index);
+    std::string GetMessDirName(size_t index);
+    std::string GetHvqBgName(size_t index);
+    std::string GetBgAnimName(size_t index);
+    void DumpFileData(tinyxml2::XMLPrinter& printer, std::string outdir);
+    void DumpMessDataExt(tinyxml2::XMLPrinter& printer, std::string basedir, size_t index);
+    void DumpMessData(tinyxml2::XMLPrinter& printer, std::string basedir, size_t index);
+    void DumpHvqData(tinyxml2::XMLPrinter& printer, std::string outdir);
+    void DumpBgAnimData(tinyxml2::XMLPrinter& printer, std::string outdir);
+    void DumpMusBank(tinyxml2::XMLPrinter& printer, std::string basedir, size_t index, SharedDataPaths& shared);
+    void DumpSfxBank(tinyxml2::XMLPrinter& printer, std::string basedir, size_t index);
+    void DumpFXData(tinyxml2::XMLPrinter& printer, std::string basedir);
+    void DumpSegments(FILE* file, std::string output);
+    void DumpGameData(std::string output);
+
+    void ParseFileData(tinyxml2::XMLElement* element, const RebuildCache* cache);
+    void ParseMessData(tinyxml2::XMLElement* element);
+    void ParseHvqData(tinyxml2::XMLElement* element);
+    void ParseBgAnimData(tinyxml2::XMLElement* element);
+    void ParseMusBank(tinyxml2::XMLElement* element);
+    void ParseSfxBank(tinyxml2::XMLElement* element);
+    void ParseFxData(tinyxml2::XMLElement* element);
+    void ParseRomData(std::string src_file, const RebuildCache* cache);
+
+    void WriteFileDataRom(FILE* file);
+    void WriteMessDataRom(FILE* file, MessDataSegment& messdata);
+    void WriteHvqDataRom(FILE* file);
+    void WriteBgAnimDataRom(FILE* file);
+    void WriteMusBankRom(FILE* file, MusBankSegment& musbank);
+    void WriteSfxBankRom(FILE* file, SfxBankSegment& sfxbank);
+    void WriteFxDataRom(FILE* file);
+    void WriteNewSegRefs(FILE* file);
+    void WriteRom(std::string output);
+    void SaveRebuildCache(std::string path);
+
+    ThreadPool& pool;
+    GameDescCache& desc_cache;
+    std::shared_ptr<const GameData> desc;
+    bool rom_parsed = false;
+    std::string error;
+    // Asset bytes not taken straight from rom_data, released by ResetGameData
+    ByteArena arena;
+    DecodeCache decode_cache;
+};